@@ -0,0 +1,127 @@
+#!/usr/bin/env python3
+"""
+Generates lookup tables from ControllerDescriptions in controllers.h
+
+usage: controllers_index.py src/controllers.h controllers_index.h
+
+Table is split into arrays, all sorted by MAKE_CONTROLLER_ID:
+  - ControllerIds: dense ids, padded so 8 ids can always be loaded
+  - ControllerTypes: type of the id at same index
+  - ControllerNames: only entries that have a name
+When an id is listed more than once, first entry wins, same as the old
+linear scan.
+"""
+import re
+import sys
+
+
+def strip_comments(text):
+    result = []
+    index = 0
+    while index < len(text):
+        if text.startswith("//", index):
+            index = text.find("\n", index)
+            if index < 0:
+                break
+        elif text.startswith("/*", index):
+            index = text.index("*/", index) + 2
+        elif text[index] == '"':
+            end = index + 1
+            while text[end] != '"':
+                end += 2 if text[end] == "\\" else 1
+            result.append(text[index : end + 1])
+            index = end + 1
+        else:
+            result.append(text[index])
+            index += 1
+    return "".join(result)
+
+
+ENTRY = re.compile(
+    r"\{\s*(ControllerType_\w+)\s*,"
+    r"\s*MAKE_CONTROLLER_ID\(\s*(0[xX][0-9a-fA-F]+)\s*,\s*(0[xX][0-9a-fA-F]+)\s*\)\s*,"
+    r'\s*(0|"(?:[^"\\]|\\.)*")\s*\}'
+)
+
+
+def parse(path):
+    with open(path) as file:
+        text = strip_comments(file.read())
+    start = text.index("ControllerDescriptions[]")
+    end = text.index("};", start)
+
+    entries = {}
+    for match in ENTRY.finditer(text, start, end):
+        type, vendor, product, name = match.groups()
+        id = int(vendor, 16) << 16 | int(product, 16)
+        if id not in entries:
+            entries[id] = (type, None if name == "0" else name)
+    return [(id,) + entries[id] for id in sorted(entries)]
+
+
+# ids loaded at once by one AVX2 compare
+LANES = 8
+PADDING_ID = 0xFFFFFFFF
+
+
+def generate(entries):
+    count = len(entries)
+    capacity = count + LANES - 1
+    names = [(id, name) for id, type, name in entries if name]
+
+    lines = [
+        "/* generated by script/controllers_index.py, do not edit */",
+        "#ifndef CONTROLLERS_INDEX_H",
+        "#define CONTROLLERS_INDEX_H",
+        "",
+        "#define CONTROLLER_COUNT %d" % count,
+        "#define CONTROLLER_ID_CAPACITY %d" % capacity,
+        "#define CONTROLLER_NAME_COUNT %d" % len(names),
+        "",
+        "static const uint32_t ControllerIds[CONTROLLER_ID_CAPACITY]",
+        "    __attribute__((aligned(32))) = {",
+    ]
+    ids = [id for id, type, name in entries]
+    ids += [PADDING_ID] * (capacity - count)
+    for index in range(0, len(ids), LANES):
+        lines.append(
+            "        " + " ".join("0x%08x," % id for id in ids[index : index + LANES])
+        )
+    lines += [
+        "};",
+        "",
+        "static const uint8_t ControllerTypes[CONTROLLER_COUNT] = {",
+    ]
+    for id, type, name in entries:
+        lines.append("    %s," % type)
+    lines += [
+        "};",
+        "",
+        "static const struct ControllerName {",
+        "  uint32_t id;",
+        "  const char *name;",
+        "} ControllerNames[CONTROLLER_NAME_COUNT] = {",
+    ]
+    for id, name in names:
+        lines.append("    {0x%08x, %s}," % (id, name))
+    lines += [
+        "};",
+        "",
+        "#endif /* CONTROLLERS_INDEX_H */",
+        "",
+    ]
+    return "\n".join(lines)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.stderr.write(__doc__)
+        return 1
+    entries = parse(sys.argv[1])
+    with open(sys.argv[2], "w") as file:
+        file.write(generate(entries))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
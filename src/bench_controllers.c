@@ -0,0 +1,116 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "controllers.h"
+
+/*
+ * Compares controller lookups over the full id set of the controller
+ * database, every known id and as many unknown ones.
+ *
+ * usage: bench-controllers [rounds]
+ */
+
+#define CONTROLLER_DESCRIPTIONS_COUNT                                          \
+  (sizeof(ControllerDescriptions) / sizeof(*ControllerDescriptions))
+
+/* what GuessControllerType did before, scan in declaration order */
+static enum ControllerType GuessControllerTypeLinear(int vendorId,
+                                                     int productId) {
+  uint32_t controllerId = (uint32_t)vendorId << 0x10 | (uint32_t)productId;
+
+  for (uint32_t index = 0; index < CONTROLLER_DESCRIPTIONS_COUNT; index++) {
+    const struct ControllerDescription *controllerDescription =
+        ControllerDescriptions + index;
+    if (controllerDescription->id == controllerId)
+      return controllerDescription->type;
+  }
+
+  return ControllerType_Unknown;
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+#define ID_MAX (CONTROLLER_DESCRIPTIONS_COUNT * 2)
+
+int main(int argc, char *argv[]) {
+  uint32_t rounds = 20000;
+  if (argc > 1 && sscanf(argv[1], "%u", &rounds) != 1) {
+    fprintf(stderr, "usage: bench-controllers [rounds]\n");
+    return 1;
+  }
+
+  /* known ids interleaved with ids next to them, mostly unknown */
+  static uint32_t ids[ID_MAX];
+  for (uint32_t index = 0; index < CONTROLLER_DESCRIPTIONS_COUNT; index++) {
+    ids[index * 2] = ControllerDescriptions[index].id;
+    ids[index * 2 + 1] = ControllerDescriptions[index].id ^ 0x5a5a;
+  }
+
+  for (uint32_t index = 0; index < ID_MAX; index++) {
+    int vendorId = (int)(ids[index] >> 16);
+    int productId = (int)(ids[index] & 0xffff);
+    if (GuessControllerType(vendorId, productId) !=
+        GuessControllerTypeLinear(vendorId, productId)) {
+      fprintf(stderr, "lookup mismatch for %04x:%04x\n", vendorId, productId);
+      return 1;
+    }
+  }
+
+  /* first entry of an id decides its name */
+  for (uint32_t index = CONTROLLER_DESCRIPTIONS_COUNT; index > 0; index--) {
+    const struct ControllerDescription *controllerDescription =
+        ControllerDescriptions + index - 1;
+    int vendorId = (int)(controllerDescription->id >> 16);
+    int productId = (int)(controllerDescription->id & 0xffff);
+    const char *name = GuessControllerName(vendorId, productId);
+    uint8_t first = 1;
+    for (uint32_t other = 0; other < index - 1; other++)
+      first &= ControllerDescriptions[other].id != controllerDescription->id;
+    const char *expected = controllerDescription->name;
+    if (first && (!name != !expected || (name && strcmp(name, expected)))) {
+      fprintf(stderr, "name mismatch for %04x:%04x\n", vendorId, productId);
+      return 1;
+    }
+  }
+
+  /* padding of id table must not be found */
+  if (GuessControllerType(0xffff, 0xffff) != ControllerType_Unknown) {
+    fprintf(stderr, "lookup found padding\n");
+    return 1;
+  }
+
+  volatile uint32_t sink = 0;
+  uint64_t lookups = (uint64_t)rounds * ID_MAX;
+
+  uint64_t start = now_ns();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint32_t index = 0; index < ID_MAX; index++)
+      sink += GuessControllerTypeLinear((int)(ids[index] >> 16),
+                                        (int)(ids[index] & 0xffff));
+  }
+  uint64_t linearNs = now_ns() - start;
+
+  start = now_ns();
+  for (uint32_t round = 0; round < rounds; round++) {
+    for (uint32_t index = 0; index < ID_MAX; index++)
+      sink += GuessControllerType((int)(ids[index] >> 16),
+                                  (int)(ids[index] & 0xffff));
+  }
+  uint64_t indexNs = now_ns() - start;
+
+  printf("ids: %lu, lookups: %llu\n", (unsigned long)ID_MAX,
+         (unsigned long long)lookups);
+  printf("linear: %.2f ns/lookup\n", (double)linearNs / (double)lookups);
+  printf("index:  %.2f ns/lookup\n", (double)indexNs / (double)lookups);
+  printf("speedup: %.1fx\n", (double)linearNs / (double)indexNs);
+  return 0;
+}
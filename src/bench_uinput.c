@@ -0,0 +1,287 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <fcntl.h>
+#include <linux/uinput.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gamepad_shm.h"
+#include "histogram.h"
+
+/*
+ * Load generator for the gamepad event loop.
+ *
+ * Starts gamepad publishing to shared memory, then creates virtual pads
+ * with /dev/uinput one at a time and measures how long each takes to show
+ * up as connected, which is the attach latency of the hotplug source.
+ * Then sends reports (ABS_X + SYN_REPORT) from every pad at a fixed rate.
+ * A reader thread follows the shared ring and measures kernel timestamp
+ * to published latency; cpu time of gamepad is taken from /proc.
+ * Needs write access to /dev/uinput and /dev/input.
+ *
+ * usage: bench-uinput [pads] [reports per second per pad] [seconds]
+ *                     [path of gamepad] [inotify|netlink]
+ */
+
+#define PAD_MAX 256
+#define SHM_NAME "/gamepad-bench"
+#define SHM_EVENTS "1048576"
+/* generator wakes up this often and sends every report that is due */
+#define TICK_NS 1000000
+/* longest a pad may take to attach */
+#define ATTACH_TIMEOUT_NS 5000000000ull
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_ns(uint64_t ns) {
+  struct timespec ts = {.tv_sec = (time_t)(ns / 1000000000),
+                        .tv_nsec = (long)(ns % 1000000000)};
+  nanosleep(&ts, 0);
+}
+
+/* Returns uinput fd of a new pad, or -1 */
+static int pad_create(uint32_t index) {
+  int fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if (fd < 0)
+    return -1;
+
+  ioctl(fd, UI_SET_EVBIT, EV_KEY);
+  ioctl(fd, UI_SET_EVBIT, EV_ABS);
+  ioctl(fd, UI_SET_KEYBIT, BTN_SOUTH);
+  ioctl(fd, UI_SET_KEYBIT, BTN_EAST);
+
+  uint16_t axes[] = {ABS_X, ABS_Y, ABS_HAT0X, ABS_HAT0Y};
+  for (uint32_t axis = 0; axis < sizeof(axes) / sizeof(*axes); axis++) {
+    uint8_t hat = axes[axis] >= ABS_HAT0X;
+    struct uinput_abs_setup setup = {
+        .code = axes[axis],
+        .absinfo = {.minimum = hat ? -1 : -32768, .maximum = hat ? 1 : 32767},
+    };
+    ioctl(fd, UI_SET_ABSBIT, axes[axis]);
+    ioctl(fd, UI_ABS_SETUP, &setup);
+  }
+
+  struct uinput_setup setup = {
+      .id = {.bustype = BUS_VIRTUAL, .vendor = 0x1209, .product = 0x0001},
+  };
+  snprintf(setup.name, sizeof(setup.name), "gamepad bench %u", index);
+  if (ioctl(fd, UI_DEV_SETUP, &setup) || ioctl(fd, UI_DEV_CREATE)) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* Returns user + system cpu time of process in nanoseconds */
+static uint64_t process_cpu_ns(pid_t pid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE *file = fopen(path, "r");
+  if (file == 0)
+    return 0;
+
+  /* utime and stime are fields 14 and 15, after the "(name)" field */
+  char line[1024];
+  unsigned long long user = 0, system = 0;
+  if (fgets(line, sizeof(line), file)) {
+    char *fields = strrchr(line, ')');
+    if (fields)
+      sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu",
+             &user, &system);
+  }
+  fclose(file);
+  return (user + system) * (1000000000ull / (uint64_t)sysconf(_SC_CLK_TCK));
+}
+
+struct reader {
+  struct gamepad_shm_consumer consumer;
+  struct histogram latency;
+  uint64_t events;
+  volatile int running;
+};
+
+/* Follows the ring until stopped, spinning so latency is not skewed */
+static void *reader_main(void *argument) {
+  struct reader *reader = argument;
+  struct gamepad_shm_event event;
+  while (reader->running) {
+    if (!gamepad_shm_next(&reader->consumer, &event)) {
+      __builtin_ia32_pause();
+      continue;
+    }
+    uint64_t now = now_ns() / 1000;
+    histogram_record(&reader->latency,
+                     (now > event.timestamp ? now - event.timestamp : 0) *
+                         1000);
+    reader->events++;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t pads = 4;
+  uint32_t rate = 1000;
+  uint32_t seconds = 5;
+  const char *gamepad = "./gamepad";
+  const char *hotplug = "inotify";
+  if ((argc > 1 && sscanf(argv[1], "%u", &pads) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%u", &rate) != 1) ||
+      (argc > 3 && sscanf(argv[3], "%u", &seconds) != 1) || pads == 0 ||
+      pads > PAD_MAX || rate == 0) {
+    fprintf(stderr, "usage: bench-uinput [pads] [reports per second per "
+                    "pad] [seconds] [path of gamepad] [inotify|netlink]\n");
+    return 1;
+  }
+  if (argc > 4)
+    gamepad = argv[4];
+  if (argc > 5)
+    hotplug = argv[5];
+
+  /* object left by a crashed run would be wiped under a claimed cursor */
+  shm_unlink(SHM_NAME);
+
+  /* pads come after gamepad, so they are attached by hotplug */
+  char maxDevices[16];
+  snprintf(maxDevices, sizeof(maxDevices), "%u", pads < 16 ? 16 : pads);
+  pid_t child = fork();
+  if (child == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    execl(gamepad, gamepad, "--max-devices", maxDevices, "--shm", SHM_NAME,
+          "--shm-events", SHM_EVENTS, "--hotplug", hotplug, (char *)0);
+    _exit(127);
+  }
+
+  /*
+   * Wait until gamepad is up. Object may exist before it has its size or
+   * before its header is ready, those are retried.
+   */
+  struct gamepad_shm_header *header = MAP_FAILED;
+  static struct gamepad_state states[PAD_MAX];
+  static struct reader reader;
+  uint64_t deadline = now_ns() + 10 * 1000000000ull;
+  while (header == MAP_FAILED) {
+    if (now_ns() >= deadline || waitpid(child, 0, WNOHANG) != 0) {
+      fprintf(stderr, "gamepad did not start\n");
+      kill(child, SIGTERM);
+      return 1;
+    }
+    sleep_ns(50000000);
+    int fd = shm_open(SHM_NAME, O_RDWR, 0);
+    if (fd < 0)
+      continue;
+    off_t size = lseek(fd, 0, SEEK_END);
+    if (size < (off_t)sizeof(*header)) {
+      close(fd);
+      continue;
+    }
+    header = mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header != MAP_FAILED &&
+        !gamepad_shm_consumer_claim(header, &reader.consumer, getpid())) {
+      munmap(header, (size_t)size);
+      header = MAP_FAILED;
+    }
+  }
+
+  /* creation of pad to its slot being connected */
+  static struct histogram attach;
+  static int fds[PAD_MAX];
+  struct gamepad_table table = gamepad_shm_table(header);
+  for (uint32_t index = 0; index < pads; index++) {
+    uint64_t start = now_ns();
+    fds[index] = pad_create(index);
+    if (fds[index] < 0) {
+      fprintf(stderr, "cannot create pad with /dev/uinput\n");
+      kill(child, SIGTERM);
+      return 1;
+    }
+    while (gamepad_table_query(&table, states, PAD_MAX) <= index) {
+      if (now_ns() - start > ATTACH_TIMEOUT_NS) {
+        fprintf(stderr, "gamepad did not attach pad\n");
+        kill(child, SIGTERM);
+        return 1;
+      }
+      __builtin_ia32_pause();
+    }
+    histogram_record(&attach, now_ns() - start);
+  }
+
+  reader.running = 1;
+  pthread_t thread;
+  pthread_create(&thread, 0, reader_main, &reader);
+
+  uint64_t cpuStart = process_cpu_ns(child);
+  uint64_t start = now_ns();
+  uint64_t end = start + (uint64_t)seconds * 1000000000ull;
+  uint64_t sent = 0;
+  uint64_t reports = 0;
+  uint64_t dropped = 0;
+  for (uint64_t now = start; now < end; now = now_ns()) {
+    uint64_t due = (now - start) * rate / 1000000000ull;
+    for (; reports < due; reports++) {
+      for (uint32_t index = 0; index < pads; index++) {
+        struct input_event events[2] = {
+            {.type = EV_ABS,
+             .code = ABS_X,
+             .value = (int32_t)(reports & 1 ? 16384 : -16384)},
+            {.type = EV_SYN, .code = SYN_REPORT},
+        };
+        if (write(fds[index], events, sizeof(events)) == sizeof(events))
+          sent += 2;
+        else
+          dropped += 2;
+      }
+    }
+    sleep_ns(TICK_NS);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  /* let loop catch up before it is measured */
+  sleep_ns(200000000);
+  uint64_t cpu = process_cpu_ns(child) - cpuStart;
+  reader.running = 0;
+  pthread_join(thread, 0);
+
+  kill(child, SIGINT);
+  waitpid(child, 0, 0);
+  for (uint32_t index = 0; index < pads; index++) {
+    ioctl(fds[index], UI_DEV_DESTROY);
+    close(fds[index]);
+  }
+
+  double elapsedSeconds = (double)elapsed / 1e9;
+  printf("attach (%s): p50: %.3fms p99: %.3fms max: %.3fms\n", hotplug,
+         histogram_percentile(&attach, 500000) / 1e6,
+         histogram_percentile(&attach, 990000) / 1e6, attach.max / 1e6);
+  printf("pads: %u, reports: %u/s per pad, seconds: %.2f\n", pads, rate,
+         elapsedSeconds);
+  printf("sent: %llu events, not accepted by uinput: %llu\n",
+         (unsigned long long)sent, (unsigned long long)dropped);
+  printf("handled: %llu events, %.0f events/s, missed by reader: %llu\n",
+         (unsigned long long)reader.events,
+         (double)reader.events / elapsedSeconds,
+         (unsigned long long)reader.consumer.cursor->dropped);
+  printf("cpu: %.1f%%, %.0f ns/event\n", (double)cpu / (double)elapsed * 100,
+         reader.events ? (double)cpu / (double)reader.events : 0.0);
+  printf("latency p50: %.1fus p99: %.1fus p99.9: %.1fus max: %.1fus\n",
+         histogram_percentile(&reader.latency, 500000) / 1000.0,
+         histogram_percentile(&reader.latency, 990000) / 1000.0,
+         histogram_percentile(&reader.latency, 999000) / 1000.0,
+         reader.latency.max / 1000.0);
+  return 0;
+}
@@ -25,6 +25,9 @@
 */
 
 #include <stdint.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 enum ControllerType {
   ControllerType_Unknown,
@@ -1327,20 +1330,71 @@ static const struct ControllerDescription ControllerDescriptions[] = {
      0}, // Valve Steam Deck Builtin Controller
 };
 
+/*
+ * ControllerIds, ControllerTypes and ControllerNames are generated from the
+ * table above at build time, see script/controllers_index.py
+ * Ids are kept apart from everything else, so the whole id set is ~2KB.
+ */
+#include "controllers_index.h"
+
+/*
+ * Branchless binary search narrows the ids down to a window of 8, then
+ * one AVX2 compare checks the whole window. Loop count only depends on
+ * table size, so lookup costs the same for every id.
+ * Returns index into ControllerTypes, or -1 when unknown.
+ */
+static inline int32_t FindController(int vendorId, int productId) {
+  uint32_t controllerId = MAKE_CONTROLLER_ID(vendorId, productId);
+
+  uint32_t base = 0;
+  uint32_t count = CONTROLLER_COUNT;
+  while (count > 8) {
+    uint32_t half = count / 2;
+    base = ControllerIds[base + half] <= controllerId ? base + half : base;
+    count -= half;
+  }
+
+#ifdef __AVX2__
+  __m256i needle = _mm256_set1_epi32((int)controllerId);
+  __m256i window =
+      _mm256_loadu_si256((const __m256i *)(ControllerIds + base));
+  uint32_t mask = (uint32_t)_mm256_movemask_ps(
+      _mm256_castsi256_ps(_mm256_cmpeq_epi32(window, needle)));
+  if (mask == 0)
+    return -1;
+  uint32_t index = base + (uint32_t)__builtin_ctz(mask);
+#else
+  uint32_t index = base;
+  while (index < base + count && ControllerIds[index] != controllerId)
+    index++;
+#endif
+
+  /* padding after last id can only match 0xffff:0xffff */
+  if (index >= CONTROLLER_COUNT || ControllerIds[index] != controllerId)
+    return -1;
+  return (int32_t)index;
+}
+
 static inline enum ControllerType GuessControllerType(int vendorId,
                                                       int productId) {
+  int32_t index = FindController(vendorId, productId);
+  return index < 0 ? ControllerType_Unknown
+                   : (enum ControllerType)ControllerTypes[index];
+}
+
+/* Returns 0 when database has no name for controller */
+static inline const char *GuessControllerName(int vendorId, int productId) {
   uint32_t controllerId = MAKE_CONTROLLER_ID(vendorId, productId);
 
-  for (uint32_t index = 0;
-       index < sizeof(ControllerDescriptions) / sizeof(*ControllerDescriptions);
-       index++) {
-    const struct ControllerDescription *controllerDescription =
-        ControllerDescriptions + index;
-    if (controllerDescription->id == controllerId)
-      return controllerDescription->type;
+  const struct ControllerName *base = ControllerNames;
+  uint32_t count = CONTROLLER_NAME_COUNT;
+  while (count > 1) {
+    uint32_t half = count / 2;
+    base = base[half].id <= controllerId ? base + half : base;
+    count -= half;
   }
 
-  return ControllerType_Unknown;
+  return base->id == controllerId ? base->name : 0;
 }
 
 #undef MAKE_CONTROLLER_ID
@@ -0,0 +1,139 @@
+#ifndef DEVICE_CACHE_H
+#define DEVICE_CACHE_H
+
+/*
+ * Capabilities of devices seen before, so a device that comes back, like
+ * a bluetooth pad that reconnects, is admitted without a libevdev probe.
+ *
+ * Keyed by input_id plus phys and uniq, which tell two pads of the same
+ * model apart, and name and key and abs bitmaps, which tell apart the
+ * nodes of one device, like the motion sensors and touchpad of a pad.
+ * Layout is a header and an open addressing table of fixed size entries,
+ * the same in memory and in the file given with --device-cache, which is
+ * used straight from mmap and kept across runs. Only joysticks are
+ * cached, other devices are rejected before they are looked up.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "record.h"
+
+#define DEVICE_CACHE_MAGIC 0x43564447 /* "GDVC" */
+#define DEVICE_CACHE_VERSION 2
+/* power of 2 */
+#define DEVICE_CACHE_COUNT 64
+#define DEVICE_CACHE_PHYS_MAX 64
+#define DEVICE_CACHE_UNIQ_MAX 32
+
+/* zeroed before it is filled, so it can be hashed and compared as bytes */
+struct device_cache_key {
+  uint16_t bustype;
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t version;
+  char name[RECORD_NAME_MAX];
+  char phys[DEVICE_CACHE_PHYS_MAX];
+  char uniq[DEVICE_CACHE_UNIQ_MAX];
+  uint8_t keys[KEY_CNT / 8];
+  uint8_t abs[ABS_CNT / 8];
+};
+
+struct device_cache_entry {
+  uint8_t used;
+  uint8_t reserved[3];
+  /* enum ControllerType */
+  int32_t controller_type;
+  struct device_cache_key key;
+  struct record_attach attach;
+};
+
+struct device_cache {
+  uint32_t magic;
+  uint32_t version;
+  /* entry count, power of 2 */
+  uint32_t count;
+  uint32_t used;
+  struct device_cache_entry entries[];
+};
+
+static inline uint64_t device_cache_size(uint32_t count) {
+  return sizeof(struct device_cache) +
+         (uint64_t)count * sizeof(struct device_cache_entry);
+}
+
+static inline void device_cache_init(struct device_cache *cache,
+                                     uint32_t count) {
+  memset(cache, 0, device_cache_size(count));
+  cache->magic = DEVICE_CACHE_MAGIC;
+  cache->version = DEVICE_CACHE_VERSION;
+  cache->count = count;
+}
+
+/* Returns 0 when data of given size is not a device cache */
+static inline uint8_t device_cache_valid(const struct device_cache *cache,
+                                         uint64_t size) {
+  return size >= sizeof(struct device_cache) &&
+         cache->magic == DEVICE_CACHE_MAGIC &&
+         cache->version == DEVICE_CACHE_VERSION && cache->count &&
+         (cache->count & (cache->count - 1)) == 0 &&
+         device_cache_size(cache->count) <= size;
+}
+
+/* FNV-1a */
+static inline uint32_t device_cache_hash(const struct device_cache_key *key) {
+  const uint8_t *bytes = (const uint8_t *)key;
+  uint32_t hash = 2166136261u;
+  for (uint32_t index = 0; index < sizeof(*key); index++) {
+    hash ^= bytes[index];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Returns entry of key, or 0 */
+static inline struct device_cache_entry *
+device_cache_find(struct device_cache *cache,
+                  const struct device_cache_key *key) {
+  uint32_t mask = cache->count - 1;
+  uint32_t bucket = device_cache_hash(key) & mask;
+  for (uint32_t probe = 0; probe < cache->count; probe++) {
+    struct device_cache_entry *entry = cache->entries + bucket;
+    if (!entry->used)
+      return 0;
+    if (memcmp(&entry->key, key, sizeof(*key)) == 0)
+      return entry;
+    bucket = (bucket + 1) & mask;
+  }
+  return 0;
+}
+
+/*
+ * Returns entry for key to be filled in. Entries are never removed, when
+ * table is full the one in the bucket of key is replaced.
+ */
+static inline struct device_cache_entry *
+device_cache_insert(struct device_cache *cache,
+                    const struct device_cache_key *key) {
+  uint32_t mask = cache->count - 1;
+  uint32_t first = device_cache_hash(key) & mask;
+  struct device_cache_entry *entry = cache->entries + first;
+  for (uint32_t probe = 0, bucket = first; probe < cache->count; probe++) {
+    struct device_cache_entry *candidate = cache->entries + bucket;
+    if (!candidate->used ||
+        memcmp(&candidate->key, key, sizeof(*key)) == 0) {
+      entry = candidate;
+      break;
+    }
+    bucket = (bucket + 1) & mask;
+  }
+
+  if (!entry->used)
+    cache->used++;
+  memset(entry, 0, sizeof(*entry));
+  entry->used = 1;
+  entry->key = *key;
+  return entry;
+}
+
+#endif /* DEVICE_CACHE_H */
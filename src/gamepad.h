@@ -0,0 +1,483 @@
+#ifndef GAMEPAD_H
+#define GAMEPAD_H
+
+/*
+ * Gamepad state aggregated from evdev events.
+ *
+ * Events are applied to a pending state as they arrive and become visible
+ * only when device says the report is complete with SYN_REPORT, so a
+ * reader never sees half of a stick movement.
+ * see: https://www.kernel.org/doc/Documentation/input/gamepad.txt
+ */
+
+#include <linux/input.h>
+#include <stdint.h>
+
+/* same order as SDL_GameControllerButton */
+enum gamepad_button {
+  GAMEPAD_BUTTON_SOUTH,
+  GAMEPAD_BUTTON_EAST,
+  GAMEPAD_BUTTON_WEST,
+  GAMEPAD_BUTTON_NORTH,
+  GAMEPAD_BUTTON_BACK,
+  GAMEPAD_BUTTON_GUIDE,
+  GAMEPAD_BUTTON_START,
+  GAMEPAD_BUTTON_LEFT_STICK,
+  GAMEPAD_BUTTON_RIGHT_STICK,
+  GAMEPAD_BUTTON_LEFT_SHOULDER,
+  GAMEPAD_BUTTON_RIGHT_SHOULDER,
+  GAMEPAD_BUTTON_DPAD_UP,
+  GAMEPAD_BUTTON_DPAD_DOWN,
+  GAMEPAD_BUTTON_DPAD_LEFT,
+  GAMEPAD_BUTTON_DPAD_RIGHT,
+  GAMEPAD_BUTTON_MISC1,
+  GAMEPAD_BUTTON_PADDLE1,
+  GAMEPAD_BUTTON_PADDLE2,
+  GAMEPAD_BUTTON_PADDLE3,
+  GAMEPAD_BUTTON_PADDLE4,
+  GAMEPAD_BUTTON_TOUCHPAD,
+  GAMEPAD_BUTTON_COUNT,
+};
+
+/* sticks are normalized to [-1, 1], down and right are positive */
+enum gamepad_axis {
+  GAMEPAD_AXIS_LEFT_X,
+  GAMEPAD_AXIS_LEFT_Y,
+  GAMEPAD_AXIS_RIGHT_X,
+  GAMEPAD_AXIS_RIGHT_Y,
+  GAMEPAD_AXIS_COUNT,
+};
+
+/* triggers are normalized to [0, 1] */
+enum gamepad_trigger {
+  GAMEPAD_TRIGGER_LEFT,
+  GAMEPAD_TRIGGER_RIGHT,
+  GAMEPAD_TRIGGER_COUNT,
+};
+
+#define GAMEPAD_HAT_COUNT 4
+
+struct gamepad_state {
+  /* incremented on every committed report */
+  uint64_t sequence;
+  /* kernel time of last committed report, in microseconds */
+  uint64_t timestamp;
+  /* slot of device, stays same while device is connected */
+  uint32_t slot;
+  /* bit (1 << enum gamepad_button) is set while button is down */
+  uint32_t buttons;
+  float axes[GAMEPAD_AXIS_COUNT];
+  float triggers[GAMEPAD_TRIGGER_COUNT];
+  /* -1, 0 or 1 for x and y of each hat */
+  int8_t hats[GAMEPAD_HAT_COUNT][2];
+  /* times kernel dropped events because we read too slowly */
+  uint32_t dropped;
+  uint8_t connected;
+};
+
+/* what an evdev code changes in gamepad state */
+enum gamepad_target {
+  GAMEPAD_TARGET_NONE,
+  GAMEPAD_TARGET_BUTTON,
+  GAMEPAD_TARGET_AXIS,
+  GAMEPAD_TARGET_TRIGGER,
+  GAMEPAD_TARGET_HAT_X,
+  GAMEPAD_TARGET_HAT_Y,
+};
+
+/* normalized = value * scale + offset, abs values normalize to [-1, 1] */
+struct gamepad_range {
+  float scale;
+  float offset;
+};
+
+/* input runs the other way */
+#define GAMEPAD_BINDING_INVERT (1 << 0)
+/* output is only one half of an axis */
+#define GAMEPAD_BINDING_HALF (1 << 1)
+/* that half is the negative one */
+#define GAMEPAD_BINDING_NEGATIVE (1 << 2)
+
+/* what an evdev code drives, index is enum gamepad_button, axis, ... */
+struct gamepad_binding {
+  uint8_t target;
+  uint8_t index;
+  uint8_t flags;
+};
+
+/* an abs code drives with its whole range, or each half separately */
+struct gamepad_abs_binding {
+  struct gamepad_binding full;
+  struct gamepad_binding negative;
+  struct gamepad_binding positive;
+};
+
+/* writer side of a device, only touched by event loop */
+struct gamepad_device {
+  struct gamepad_state pending;
+  /* events are discarded from SYN_DROPPED until next SYN_REPORT */
+  uint8_t syncing;
+  struct gamepad_range ranges[ABS_CNT];
+  struct gamepad_binding keys[KEY_CNT];
+  struct gamepad_abs_binding abs[ABS_CNT];
+};
+
+/*
+ * Committed state of a device behind a seqlock.
+ * lock is odd while event loop writes state, readers copy state and retry
+ * when lock was odd or changed meanwhile. Writer never waits for readers.
+ * Slots start on a cache line and never share one, so readers of one pad
+ * do not slow down writes to another. Lock and state take 72 bytes, so a
+ * slot spans two lines.
+ */
+struct gamepad_slot {
+  uint32_t lock;
+  struct gamepad_state state;
+} __attribute__((aligned(64)));
+
+/* readers find committed state of every slot here */
+struct gamepad_table {
+  struct gamepad_slot *slots;
+  uint32_t max;
+};
+
+/*
+ * State is copied as words so that racing reads and writes stay atomic.
+ * Its size is a multiple of its 8 byte alignment.
+ */
+#define GAMEPAD_STATE_WORDS (sizeof(struct gamepad_state) / sizeof(uint32_t))
+
+/*
+ * Default layout of linux gamepad api.
+ * Returns what key code changes and writes button index to *index.
+ */
+static inline enum gamepad_target gamepad_key_target(uint16_t code,
+                                                     uint8_t *index) {
+  switch (code) {
+  case BTN_SOUTH:
+    *index = GAMEPAD_BUTTON_SOUTH;
+    break;
+  case BTN_EAST:
+    *index = GAMEPAD_BUTTON_EAST;
+    break;
+  case BTN_WEST:
+    *index = GAMEPAD_BUTTON_WEST;
+    break;
+  case BTN_NORTH:
+    *index = GAMEPAD_BUTTON_NORTH;
+    break;
+  case BTN_SELECT:
+    *index = GAMEPAD_BUTTON_BACK;
+    break;
+  case BTN_MODE:
+    *index = GAMEPAD_BUTTON_GUIDE;
+    break;
+  case BTN_START:
+    *index = GAMEPAD_BUTTON_START;
+    break;
+  case BTN_THUMBL:
+    *index = GAMEPAD_BUTTON_LEFT_STICK;
+    break;
+  case BTN_THUMBR:
+    *index = GAMEPAD_BUTTON_RIGHT_STICK;
+    break;
+  case BTN_TL:
+    *index = GAMEPAD_BUTTON_LEFT_SHOULDER;
+    break;
+  case BTN_TR:
+    *index = GAMEPAD_BUTTON_RIGHT_SHOULDER;
+    break;
+  case BTN_DPAD_UP:
+    *index = GAMEPAD_BUTTON_DPAD_UP;
+    break;
+  case BTN_DPAD_DOWN:
+    *index = GAMEPAD_BUTTON_DPAD_DOWN;
+    break;
+  case BTN_DPAD_LEFT:
+    *index = GAMEPAD_BUTTON_DPAD_LEFT;
+    break;
+  case BTN_DPAD_RIGHT:
+    *index = GAMEPAD_BUTTON_DPAD_RIGHT;
+    break;
+  /* digital triggers */
+  case BTN_TL2:
+    *index = GAMEPAD_TRIGGER_LEFT;
+    return GAMEPAD_TARGET_TRIGGER;
+  case BTN_TR2:
+    *index = GAMEPAD_TRIGGER_RIGHT;
+    return GAMEPAD_TARGET_TRIGGER;
+  default:
+    return GAMEPAD_TARGET_NONE;
+  }
+  return GAMEPAD_TARGET_BUTTON;
+}
+
+/*
+ * Default layout of linux gamepad api.
+ * Returns what abs code changes and writes axis, trigger or hat index to
+ * *index.
+ */
+static inline enum gamepad_target gamepad_abs_target(uint16_t code,
+                                                     uint8_t *index) {
+  switch (code) {
+  case ABS_X:
+    *index = GAMEPAD_AXIS_LEFT_X;
+    return GAMEPAD_TARGET_AXIS;
+  case ABS_Y:
+    *index = GAMEPAD_AXIS_LEFT_Y;
+    return GAMEPAD_TARGET_AXIS;
+  case ABS_RX:
+    *index = GAMEPAD_AXIS_RIGHT_X;
+    return GAMEPAD_TARGET_AXIS;
+  case ABS_RY:
+    *index = GAMEPAD_AXIS_RIGHT_Y;
+    return GAMEPAD_TARGET_AXIS;
+  case ABS_Z:
+    *index = GAMEPAD_TRIGGER_LEFT;
+    return GAMEPAD_TARGET_TRIGGER;
+  case ABS_RZ:
+    *index = GAMEPAD_TRIGGER_RIGHT;
+    return GAMEPAD_TARGET_TRIGGER;
+  }
+
+  if (code >= ABS_HAT0X && code <= ABS_HAT3Y) {
+    *index = (uint8_t)((code - ABS_HAT0X) / 2);
+    return (code - ABS_HAT0X) % 2 ? GAMEPAD_TARGET_HAT_Y : GAMEPAD_TARGET_HAT_X;
+  }
+  return GAMEPAD_TARGET_NONE;
+}
+
+/* Tells how raw values of abs code map to its normalized range */
+static inline void gamepad_device_set_range(struct gamepad_device *device,
+                                            uint16_t code, int32_t minimum,
+                                            int32_t maximum) {
+  if (code >= ABS_CNT || maximum <= minimum)
+    return;
+
+  struct gamepad_range *range = device->ranges + code;
+  float span = (float)maximum - (float)minimum;
+  range->scale = 2.0f / span;
+  range->offset = -1.0f - 2.0f * (float)minimum / span;
+}
+
+/* Drops every binding, used before a mapping is applied */
+static inline void gamepad_device_unbind(struct gamepad_device *device) {
+  for (uint32_t code = 0; code < KEY_CNT; code++)
+    device->keys[code] = (struct gamepad_binding){0};
+  for (uint32_t code = 0; code < ABS_CNT; code++)
+    device->abs[code] = (struct gamepad_abs_binding){{0}};
+}
+
+/* Binds codes by default layout of linux gamepad api */
+static inline void gamepad_device_init(struct gamepad_device *device,
+                                       uint32_t slot) {
+  device->pending = (struct gamepad_state){
+      .slot = slot,
+      .connected = 1,
+  };
+  device->syncing = 0;
+  for (uint32_t code = 0; code < ABS_CNT; code++) {
+    device->ranges[code] = (struct gamepad_range){.scale = 1.0f};
+    struct gamepad_abs_binding *binding = device->abs + code;
+    *binding = (struct gamepad_abs_binding){{0}};
+    binding->full.target =
+        (uint8_t)gamepad_abs_target((uint16_t)code, &binding->full.index);
+  }
+  for (uint32_t code = 0; code < KEY_CNT; code++) {
+    struct gamepad_binding *binding = device->keys + code;
+    *binding = (struct gamepad_binding){0};
+    binding->target =
+        (uint8_t)gamepad_key_target((uint16_t)code, &binding->index);
+  }
+}
+
+/*
+ * Writes value to what binding drives.
+ * value is in [-1, 1] when full is set, otherwise in [0, 1].
+ */
+static inline void gamepad_apply(struct gamepad_state *state,
+                                 const struct gamepad_binding *binding,
+                                 float value, uint8_t full, int32_t raw) {
+  if (binding->flags & GAMEPAD_BINDING_INVERT)
+    value = full ? -value : 1.0f - value;
+
+  uint8_t index = binding->index;
+  switch (binding->target) {
+  case GAMEPAD_TARGET_BUTTON:
+    if (full ? value > 0.0f : value > 0.5f)
+      state->buttons |= (uint32_t)1 << index;
+    else
+      state->buttons &= ~((uint32_t)1 << index);
+    break;
+  case GAMEPAD_TARGET_AXIS:
+    if (binding->flags & GAMEPAD_BINDING_HALF) {
+      float half = full ? (value + 1.0f) * 0.5f : value;
+      state->axes[index] =
+          binding->flags & GAMEPAD_BINDING_NEGATIVE ? -half : half;
+    } else {
+      state->axes[index] = full ? value : value * 2.0f - 1.0f;
+    }
+    break;
+  case GAMEPAD_TARGET_TRIGGER:
+    state->triggers[index] = full ? (value + 1.0f) * 0.5f : value;
+    break;
+  case GAMEPAD_TARGET_HAT_X:
+    state->hats[index][0] = (int8_t)(raw > 0 ? 1 : raw < 0 ? -1 : 0);
+    break;
+  case GAMEPAD_TARGET_HAT_Y:
+    state->hats[index][1] = (int8_t)(raw > 0 ? 1 : raw < 0 ? -1 : 0);
+    break;
+  }
+}
+
+static inline void gamepad_apply_abs(struct gamepad_state *state,
+                                     const struct gamepad_abs_binding *binding,
+                                     float value, int32_t raw) {
+  gamepad_apply(state, &binding->full, value, 1, raw);
+
+  float positive = value > 0.0f ? value : 0.0f;
+  float negative = value < 0.0f ? -value : 0.0f;
+  const struct gamepad_binding *low = &binding->negative;
+  const struct gamepad_binding *high = &binding->positive;
+
+  /* both halves drive one axis, like a hat used as stick */
+  if (low->target == GAMEPAD_TARGET_AXIS &&
+      high->target == GAMEPAD_TARGET_AXIS && low->index == high->index &&
+      (low->flags & high->flags & GAMEPAD_BINDING_HALF)) {
+    state->axes[low->index] =
+        (high->flags & GAMEPAD_BINDING_NEGATIVE ? -positive : positive) +
+        (low->flags & GAMEPAD_BINDING_NEGATIVE ? -negative : negative);
+    return;
+  }
+
+  gamepad_apply(state, low, negative, 0, raw);
+  gamepad_apply(state, high, positive, 0, raw);
+}
+
+/* what caller does after gamepad_device_update */
+#define GAMEPAD_UPDATE_NONE 0
+/* report is complete, publish pending state */
+#define GAMEPAD_UPDATE_REPORT 1
+/*
+ * events were lost, read whole state of device into pending and
+ * finish with gamepad_device_commit
+ */
+#define GAMEPAD_UPDATE_RESYNC 2
+
+static inline void gamepad_device_commit(struct gamepad_device *device,
+                                         const struct input_event *event) {
+  device->pending.sequence++;
+  device->pending.timestamp = (uint64_t)event->input_event_sec * 1000000 +
+                              (uint64_t)event->input_event_usec;
+}
+
+/*
+ * Applies event to pending state.
+ * Returns one of GAMEPAD_UPDATE_*.
+ * see: https://www.kernel.org/doc/html/latest/input/event-codes.html#ev-syn
+ */
+static inline uint8_t gamepad_device_update(struct gamepad_device *device,
+                                            const struct input_event *event) {
+  if (event->type == EV_SYN && event->code == SYN_DROPPED) {
+    device->syncing = 1;
+    device->pending.dropped++;
+    return GAMEPAD_UPDATE_NONE;
+  }
+  if (device->syncing) {
+    if (event->type != EV_SYN || event->code != SYN_REPORT)
+      return GAMEPAD_UPDATE_NONE;
+    device->syncing = 0;
+    return GAMEPAD_UPDATE_RESYNC;
+  }
+
+  switch (event->type) {
+  case EV_KEY:
+    if (event->code >= KEY_CNT)
+      return GAMEPAD_UPDATE_NONE;
+    gamepad_apply(&device->pending, device->keys + event->code,
+                  event->value ? 1.0f : 0.0f, 0, event->value);
+    return GAMEPAD_UPDATE_NONE;
+
+  case EV_ABS:
+    if (event->code >= ABS_CNT)
+      return GAMEPAD_UPDATE_NONE;
+    struct gamepad_range *range = device->ranges + event->code;
+    gamepad_apply_abs(&device->pending, device->abs + event->code,
+                      (float)event->value * range->scale + range->offset,
+                      event->value);
+    return GAMEPAD_UPDATE_NONE;
+
+  case EV_SYN:
+    if (event->code != SYN_REPORT)
+      return GAMEPAD_UPDATE_NONE;
+    gamepad_device_commit(device, event);
+    return GAMEPAD_UPDATE_REPORT;
+  }
+
+  return GAMEPAD_UPDATE_NONE;
+}
+
+static inline void gamepad_state_copy(struct gamepad_state *dest,
+                                      const struct gamepad_state *src) {
+  uint32_t *to = (uint32_t *)dest;
+  const uint32_t *from = (const uint32_t *)src;
+  for (uint32_t index = 0; index < GAMEPAD_STATE_WORDS; index++)
+    __atomic_store_n(to + index, __atomic_load_n(from + index, __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+}
+
+/* Only called from event loop, the single writer */
+static inline void gamepad_table_publish(struct gamepad_table *table,
+                                         uint32_t slot,
+                                         const struct gamepad_state *state) {
+  struct gamepad_slot *entry = table->slots + slot;
+  uint32_t lock = __atomic_load_n(&entry->lock, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&entry->lock, lock + 1, __ATOMIC_RELAXED);
+  /* state stores must not become visible before lock is odd */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  gamepad_state_copy(&entry->state, state);
+  __atomic_store_n(&entry->lock, lock + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies committed state of slot to out, safe from any thread.
+ * Retries only while event loop is in the middle of a write to this slot.
+ */
+static inline void gamepad_table_read(const struct gamepad_table *table,
+                                      uint32_t slot,
+                                      struct gamepad_state *out) {
+  const struct gamepad_slot *entry = table->slots + slot;
+  uint32_t before, after;
+  do {
+    before = __atomic_load_n(&entry->lock, __ATOMIC_ACQUIRE);
+    while (before & 1) {
+#if defined(__x86_64__) || defined(__i386__)
+      __builtin_ia32_pause();
+#endif
+      before = __atomic_load_n(&entry->lock, __ATOMIC_ACQUIRE);
+    }
+    gamepad_state_copy(out, &entry->state);
+    /* state loads must complete before lock is checked again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&entry->lock, __ATOMIC_RELAXED);
+  } while (before != after);
+}
+
+/*
+ * Copies committed state of every connected gamepad to out.
+ * Returns number of states written.
+ */
+static inline uint32_t gamepad_table_query(const struct gamepad_table *table,
+                                           struct gamepad_state *out,
+                                           uint32_t max) {
+  uint32_t count = 0;
+  for (uint32_t slot = 0; slot < table->max && count < max; slot++) {
+    gamepad_table_read(table, slot, out + count);
+    if (out[count].connected)
+      count++;
+  }
+  return count;
+}
+
+#endif /* GAMEPAD_H */
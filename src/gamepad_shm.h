@@ -0,0 +1,215 @@
+#ifndef GAMEPAD_SHM_H
+#define GAMEPAD_SHM_H
+
+/*
+ * Shared memory layout that gamepad daemon publishes into with --shm.
+ *
+ * Region holds a header, gamepad state table (see gamepad.h) and a single
+ * producer multi consumer ring of events. Producer never waits for
+ * consumers: every consumer claims a cursor, follows the ring at its own
+ * pace and skips ahead when it falls more than a ring behind. Cursors of
+ * consumers that died are taken over by the next claim.
+ * Reading costs no syscalls, consumers read straight from the mapping.
+ *
+ *   int fd = shm_open("/gamepad", O_RDWR, 0);
+ *   struct gamepad_shm_header *header = mmap(..., MAP_SHARED, fd, 0);
+ *   struct gamepad_shm_consumer consumer;
+ *   gamepad_shm_consumer_claim(header, &consumer, getpid());
+ *   while (gamepad_shm_next(&consumer, &event)) ...
+ */
+
+#include <errno.h>
+#include <signal.h>
+
+#include "gamepad.h"
+
+#define GAMEPAD_SHM_MAGIC 0x44415047 /* "GPAD" */
+#define GAMEPAD_SHM_VERSION 2
+#define GAMEPAD_SHM_NAME_DEFAULT "/gamepad"
+#define GAMEPAD_SHM_EVENT_COUNT_DEFAULT 4096
+#define GAMEPAD_SHM_CONSUMER_MAX 16
+
+/* evdev event tagged with the slot of device it came from */
+struct gamepad_shm_event {
+  /* index + 1 of ring position when complete, 0 while being written */
+  uint64_t sequence;
+  /* kernel time of event, in microseconds */
+  uint64_t timestamp;
+  uint32_t slot;
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+  uint32_t reserved;
+};
+
+struct gamepad_shm_cursor {
+  /* pid of consumer, 0 when free */
+  int32_t pid;
+  uint32_t reserved;
+  /* next ring index consumer reads, written only by its consumer */
+  uint64_t read_index;
+  /* events consumer missed because it fell behind */
+  uint64_t dropped;
+} __attribute__((aligned(64)));
+
+struct gamepad_shm_header {
+  /* GAMEPAD_SHM_MAGIC once region is ready */
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint32_t slot_max;
+  /* event_count - 1, event_count is power of 2 */
+  uint32_t event_mask;
+  uint32_t consumer_max;
+  uint32_t reserved;
+  /* from start of header */
+  uint64_t slots_offset;
+  uint64_t events_offset;
+  uint64_t cursors_offset;
+
+  /* written only by producer, on its own cache line */
+  uint64_t write_index __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+static inline struct gamepad_table
+gamepad_shm_table(struct gamepad_shm_header *header) {
+  return (struct gamepad_table){
+      .slots =
+          (struct gamepad_slot *)((char *)header + header->slots_offset),
+      .max = header->slot_max,
+  };
+}
+
+static inline struct gamepad_shm_event *
+gamepad_shm_events(struct gamepad_shm_header *header) {
+  return (struct gamepad_shm_event *)((char *)header + header->events_offset);
+}
+
+static inline struct gamepad_shm_cursor *
+gamepad_shm_cursors(struct gamepad_shm_header *header) {
+  return (struct gamepad_shm_cursor *)((char *)header +
+                                       header->cursors_offset);
+}
+
+/* Only called by producer */
+static inline void gamepad_shm_push(struct gamepad_shm_header *header,
+                                    uint32_t slot,
+                                    const struct input_event *event) {
+  uint64_t index = __atomic_load_n(&header->write_index, __ATOMIC_RELAXED);
+  struct gamepad_shm_event *entry =
+      gamepad_shm_events(header) + (index & header->event_mask);
+
+  __atomic_store_n(&entry->sequence, 0, __ATOMIC_RELAXED);
+  /* field stores must not become visible before entry is marked */
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&entry->timestamp,
+                   (uint64_t)event->input_event_sec * 1000000 +
+                       (uint64_t)event->input_event_usec,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->slot, slot, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->type, event->type, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->code, event->code, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->value, event->value, __ATOMIC_RELAXED);
+  __atomic_store_n(&entry->sequence, index + 1, __ATOMIC_RELEASE);
+  __atomic_store_n(&header->write_index, index + 1, __ATOMIC_RELEASE);
+}
+
+struct gamepad_shm_consumer {
+  struct gamepad_shm_header *header;
+  struct gamepad_shm_cursor *cursor;
+  struct gamepad_shm_event *events;
+  /* local copy of cursor->read_index */
+  uint64_t read_index;
+};
+
+/*
+ * Takes a free cursor and starts reading from newest event. Cursor of a
+ * consumer that exited without releasing it, whose pid no longer exists,
+ * counts as free.
+ * Returns 0 when region is not ready or all cursors are taken.
+ */
+static inline uint8_t
+gamepad_shm_consumer_claim(struct gamepad_shm_header *header,
+                           struct gamepad_shm_consumer *consumer,
+                           int32_t pid) {
+  if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != GAMEPAD_SHM_MAGIC ||
+      header->version != GAMEPAD_SHM_VERSION)
+    return 0;
+
+  struct gamepad_shm_cursor *cursors = gamepad_shm_cursors(header);
+  for (uint32_t index = 0; index < header->consumer_max; index++) {
+    int32_t expected = __atomic_load_n(&cursors[index].pid, __ATOMIC_RELAXED);
+    /* EPERM means process exists, it is only not ours */
+    if (expected != 0 && (kill(expected, 0) == 0 || errno != ESRCH))
+      continue;
+    if (!__atomic_compare_exchange_n(&cursors[index].pid, &expected, pid, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+      continue;
+
+    consumer->header = header;
+    consumer->cursor = cursors + index;
+    consumer->events = gamepad_shm_events(header);
+    consumer->read_index =
+        __atomic_load_n(&header->write_index, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&consumer->cursor->read_index, consumer->read_index,
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&consumer->cursor->dropped, 0, __ATOMIC_RELAXED);
+    return 1;
+  }
+  return 0;
+}
+
+static inline void
+gamepad_shm_consumer_release(struct gamepad_shm_consumer *consumer) {
+  __atomic_store_n(&consumer->cursor->pid, 0, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies next event to out.
+ * Returns 0 when consumer has seen every published event.
+ */
+static inline uint8_t gamepad_shm_next(struct gamepad_shm_consumer *consumer,
+                                       struct gamepad_shm_event *out) {
+  struct gamepad_shm_header *header = consumer->header;
+  uint64_t count = (uint64_t)header->event_mask + 1;
+
+  while (1) {
+    uint64_t write_index =
+        __atomic_load_n(&header->write_index, __ATOMIC_ACQUIRE);
+    if (consumer->read_index == write_index)
+      return 0;
+
+    /* producer lapped us, oldest events are gone */
+    if (write_index - consumer->read_index > count) {
+      uint64_t skipped = write_index - count - consumer->read_index;
+      __atomic_store_n(&consumer->cursor->dropped,
+                       consumer->cursor->dropped + skipped, __ATOMIC_RELAXED);
+      consumer->read_index = write_index - count;
+    }
+
+    uint64_t index = consumer->read_index;
+    struct gamepad_shm_event *entry =
+        consumer->events + (index & header->event_mask);
+    uint64_t before = __atomic_load_n(&entry->sequence, __ATOMIC_ACQUIRE);
+    out->timestamp = __atomic_load_n(&entry->timestamp, __ATOMIC_RELAXED);
+    out->slot = __atomic_load_n(&entry->slot, __ATOMIC_RELAXED);
+    out->type = __atomic_load_n(&entry->type, __ATOMIC_RELAXED);
+    out->code = __atomic_load_n(&entry->code, __ATOMIC_RELAXED);
+    out->value = __atomic_load_n(&entry->value, __ATOMIC_RELAXED);
+    /* field loads must complete before entry is checked again */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint64_t after = __atomic_load_n(&entry->sequence, __ATOMIC_RELAXED);
+
+    /* overwritten while copying, catch up and try again */
+    if (before != index + 1 || after != before)
+      continue;
+
+    out->sequence = before;
+    consumer->read_index = index + 1;
+    __atomic_store_n(&consumer->cursor->read_index, consumer->read_index,
+                     __ATOMIC_RELEASE);
+    return 1;
+  }
+}
+
+#endif /* GAMEPAD_SHM_H */
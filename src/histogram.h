@@ -0,0 +1,92 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear histogram of nanosecond values.
+ *
+ * Every power of 2 range is split into HISTOGRAM_SUB_COUNT linear buckets,
+ * so error of a percentile is below 1 / HISTOGRAM_SUB_COUNT of the value
+ * whatever its magnitude. Values below HISTOGRAM_SUB_COUNT are exact.
+ * Only event loop records, counters are updated with relaxed atomics so
+ * other threads can read them at any time without locks.
+ */
+
+#include <stdint.h>
+
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+/* values from 2^40 ns, about 18 minutes, land in the last bucket */
+#define HISTOGRAM_MAX_BITS 40
+#define HISTOGRAM_BUCKET_COUNT                                                 \
+  ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT)
+
+struct histogram {
+  uint64_t count;
+  uint64_t max;
+  uint32_t buckets[HISTOGRAM_BUCKET_COUNT];
+};
+
+static inline uint32_t histogram_index(uint64_t value) {
+  if (value < HISTOGRAM_SUB_COUNT)
+    return (uint32_t)value;
+  if (value >= (uint64_t)1 << HISTOGRAM_MAX_BITS)
+    return HISTOGRAM_BUCKET_COUNT - 1;
+
+  uint32_t exponent = 63 - (uint32_t)__builtin_clzll(value);
+  uint32_t shift = exponent - HISTOGRAM_SUB_BITS;
+  return (exponent - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_COUNT +
+         (uint32_t)((value >> shift) & (HISTOGRAM_SUB_COUNT - 1));
+}
+
+/* Smallest value that falls into bucket */
+static inline uint64_t histogram_value(uint32_t index) {
+  if (index < HISTOGRAM_SUB_COUNT)
+    return index;
+
+  uint32_t exponent = index / HISTOGRAM_SUB_COUNT + HISTOGRAM_SUB_BITS - 1;
+  uint64_t sub = index % HISTOGRAM_SUB_COUNT;
+  return ((uint64_t)HISTOGRAM_SUB_COUNT + sub)
+         << (exponent - HISTOGRAM_SUB_BITS);
+}
+
+static inline void histogram_reset(struct histogram *histogram) {
+  __atomic_store_n(&histogram->count, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->max, 0, __ATOMIC_RELAXED);
+  for (uint32_t index = 0; index < HISTOGRAM_BUCKET_COUNT; index++)
+    __atomic_store_n(histogram->buckets + index, 0, __ATOMIC_RELAXED);
+}
+
+/* Only called by the single writer */
+static inline void histogram_record(struct histogram *histogram,
+                                    uint64_t value) {
+  uint32_t *bucket = histogram->buckets + histogram_index(value);
+  __atomic_store_n(bucket, __atomic_load_n(bucket, __ATOMIC_RELAXED) + 1,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&histogram->count, histogram->count + 1, __ATOMIC_RELAXED);
+  if (value > histogram->max)
+    __atomic_store_n(&histogram->max, value, __ATOMIC_RELAXED);
+}
+
+/*
+ * Returns value at or below which given parts per million of values are,
+ * e.g. 500000 for p50 and 999000 for p99.9.
+ */
+static inline uint64_t histogram_percentile(const struct histogram *histogram,
+                                            uint32_t ppm) {
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  if (count == 0)
+    return 0;
+
+  uint64_t rank = (count * ppm + 999999) / 1000000;
+  if (rank == 0)
+    rank = 1;
+  uint64_t seen = 0;
+  for (uint32_t index = 0; index < HISTOGRAM_BUCKET_COUNT; index++) {
+    seen += __atomic_load_n(histogram->buckets + index, __ATOMIC_RELAXED);
+    if (seen >= rank)
+      return histogram_value(index);
+  }
+  return __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+}
+
+#endif /* HISTOGRAM_H */
@@ -5,19 +5,31 @@
 #include <dirent.h>
 #include <fcntl.h>
 #include <libevdev/libevdev.h>
+#include <limits.h>
 #include <liburing.h>
 #include <linux/input.h>
+#include <linux/netlink.h>
+#include <signal.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/inotify.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "controllers.h"
-
-#define POLLIN 0x001  /* There is data to read.  */
-#define POLLPRI 0x002 /* There is urgent data to read.  */
-#define POLLOUT 0x004 /* Writing now will not block.  */
+#include "device_cache.h"
+#include "gamepad.h"
+#include "gamepad_shm.h"
+#include "histogram.h"
+#include "mapping.h"
+#include "output.h"
+#include "record.h"
 
 typedef unsigned char u8;
 typedef unsigned short u16;
@@ -29,19 +41,35 @@ typedef unsigned long long u64;
 #define OP_JOYSTICK_POLL (1 << 2)
 #define OP_JOYSTICK_READ (1 << 3)
 #define OP_JOYSTICK_CLOSE (1 << 4)
+#define OP_SIGNAL (1 << 5)
+#define OP_REPLAY (1 << 6)
+#define OP_OUTPUT (1 << 7)
+#define OP_UEVENT (1 << 8)
 
 #define ACTION_ADD (1 << 0)
 #define ACTION_REMOVE (1 << 1)
 
+#define GAMEPAD_ERROR_ARGUMENT 50
+
+#define GAMEPAD_ERROR_MAPPINGS 60
+
+#define GAMEPAD_ERROR_RECORD 70
+#define GAMEPAD_ERROR_REPLAY 71
+
+/* not an error, asked to stop by a signal */
+#define GAMEPAD_STOP 100
+
 #define GAMEPAD_ERROR_IO_URING_SETUP 1
 #define GAMEPAD_ERROR_IO_URING_WAIT 2
 
 #define GAMEPAD_ERROR_MEMORY 40
+#define GAMEPAD_ERROR_SHM 41
 
 #define GAMEPAD_ERROR_INOTIFY_SETUP 10
 #define GAMEPAD_ERROR_INOTIFY_WATCH_SETUP 11
 #define GAMEPAD_ERROR_INOTIFY_WATCH 12
-#define GAMEPAD_ERROR_INOTIFY_WATCH_POLL 12
+#define GAMEPAD_ERROR_UEVENT_SETUP 13
+#define GAMEPAD_ERROR_UEVENT 14
 
 #define GAMEPAD_ERROR_DEV_INPUT_DIR_OPEN 20
 #define GAMEPAD_ERROR_DEV_INPUT_DIR_READ 21
@@ -54,20 +82,245 @@ typedef unsigned long long u64;
 #define warning(str) write(2, "w: " str, 3 + sizeof(str) - 1)
 
 struct op {
-  u8 type;
+  u16 type;
   int fd;
 };
 
+/*
+ * Node that is being opened, from startup scan or its inotify event until
+ * it is attached or given up on. Open is tried right away. Until udev has
+ * set permissions it fails with EACCES, or with ENODEV before device is
+ * registered, and is retried with exponential backoff. IN_ATTRIB retries
+ * right away, IN_DELETE cancels whatever is in flight.
+ */
+#define HOTPLUG_OPENING 0
+#define HOTPLUG_WAITING 1
+/* first retry, doubles on every attempt */
+#define HOTPLUG_RETRY_NS 2000000
+#define HOTPLUG_ATTEMPT_MAX 10
+
 struct op_device_open {
-  u8 type;
+  u16 type;
+  /* queued by startup scan, not retried */
+  u8 scan : 1;
+  /* node was removed, op is freed when its completion arrives */
+  u8 cancelled : 1;
+  /* permissions changed, open again without waiting */
+  u8 retry : 1;
+  /* HOTPLUG_* */
+  u8 state;
+  u8 attempt;
+  /* next node being opened */
+  struct op_device_open *next;
+  /* when node was reported, for attach latency */
+  u64 start_ns;
+  struct __kernel_timespec timeout;
   const char path[32];
 };
 
 struct op_joystick_read {
-  u8 type;
+  u16 type;
   u8 initialized : 1;
+  /* whether the read in flight is multishot */
+  u8 multishot : 1;
+  /* event time is CLOCK_MONOTONIC instead of CLOCK_REALTIME */
+  u8 monotonic : 1;
+  int fd;
+  /* index in registered file table and gamepad table */
+  u32 slot;
+  struct gamepad_device gamepad;
+  /* number of events that fits into events[] */
+  u32 event_max;
+  struct input_event events[];
+};
+
+/*
+ * Reads of inotify watch on /dev/input go through the ring into buffer.
+ * A read returns as many whole events as fit, and fails with EINVAL when
+ * not even one does, so buffer holds at least one with the longest name.
+ */
+#define INOTIFY_BUFFER_SIZE 4096
+
+struct op_inotify {
+  u16 type;
+  int fd;
+  /* after int, so aligned for struct inotify_event */
+  u8 buffer[INOTIFY_BUFFER_SIZE];
+};
+
+/* SIGUSR1 prints latency, SIGINT and SIGTERM stop the loop */
+struct op_signal {
+  u16 type;
+  int fd;
+  struct signalfd_siginfo info;
+};
+
+/*
+ * Kernel uevents of input devices, with --hotplug netlink.
+ * Messages are "ACTION@DEVPATH" and then KEY=VALUE strings, all 0
+ * terminated. They are received with multishot recvmsg into a provided
+ * buffer ring, or one at a time into the first buffer when kernel does
+ * not support that.
+ */
+#define UEVENT_BUFFER_GROUP 1
+#define UEVENT_BUFFER_SIZE (8 * KILOBYTES)
+#define UEVENT_BUFFER_COUNT 16
+#define UEVENT_PARENT_MAX 8
+#define UEVENT_DEVPATH_MAX 256
+#define UEVENT_PRODUCT_MAX 32
+
+/*
+ * Uevent of an input device, arrives right before uevent of its event
+ * node and tells what device is without opening it.
+ */
+struct uevent_parent {
+  char devpath[UEVENT_DEVPATH_MAX];
+  /* bus/vendor/product/version in hex */
+  char product[UEVENT_PRODUCT_MAX];
+  /* has ABS_HAT0X, like device_is_joystick */
+  u8 joystick;
+};
+
+struct op_uevent {
+  u16 type;
+  u8 multishot : 1;
   int fd;
-  struct input_event event;
+  struct msghdr msg;
+  /* single-shot receive only */
+  struct sockaddr_nl name;
+  struct iovec iov;
+  struct io_uring_buf_ring *br;
+  u8 *buffers;
+  /* most recent input devices, oldest is replaced */
+  u32 parent_next;
+  struct uevent_parent parents[UEVENT_PARENT_MAX];
+};
+
+/*
+ * Plays a record back into pipes that are read like devices.
+ * Writes are at most PIPE_BUF, so they are atomic and a read never sees
+ * part of an event.
+ */
+#define REPLAY_WRITE_MAX (PIPE_BUF / sizeof(struct input_event))
+
+struct op_replay {
+  u16 type;
+  /* timeout until next batch is due is in flight */
+  u8 waiting : 1;
+  /* every entry is played and pipes are closed */
+  u8 done : 1;
+  /* as fast as possible instead of original timing */
+  u8 fast : 1;
+  const u8 *data;
+  u64 size;
+  u64 offset;
+  /* events of current entry that are not written yet */
+  const struct record_event *pending;
+  u32 pending_count;
+  u16 pending_slot;
+  /* replay devices whose read end is still attached */
+  u32 active;
+  u64 events;
+  /* record time of first event and when it was played */
+  u64 first_time;
+  u64 start_ns;
+  u64 end_ns;
+  struct __kernel_timespec timeout;
+  struct input_event buffer[REPLAY_WRITE_MAX];
+  /* write end of pipe for every recorded slot, -1 when closed */
+  u32 fd_max;
+  int fds[];
+};
+
+#define EVENTS_PER_READ_DEFAULT 64
+#define EVENTS_PER_READ_MAX 512
+
+/*
+ * Which events kernel passes to us, installed with EVIOCSMASK.
+ * Filtered events are dropped before they are queued for our fd.
+ */
+#define SUBSCRIBE_DEFAULT 0
+/* only codes that gamepad state is built from */
+#define SUBSCRIBE_BOUND 1
+/* everything, no mask */
+#define SUBSCRIBE_ALL 2
+/* types and codes listed with --subscribe */
+#define SUBSCRIBE_LIST 3
+
+struct subscription {
+  u8 mode;
+  /* bitmaps */
+  u8 types[EV_CNT / 8];
+  u8 keys[KEY_CNT / 8];
+  u8 abs[ABS_CNT / 8];
+};
+
+struct config {
+  /* how many input_events a single read can return from a device */
+  u32 events_per_read;
+  /* how many joysticks can be attached at the same time */
+  u32 device_max;
+  /* read with IORING_OP_READ_MULTISHOT from the joystick buffer ring */
+  u8 read_multishot : 1;
+  /* refer to devices by their slot in a registered file table */
+  u8 fixed_files : 1;
+  /* single-shot reads go into registered joystick op memory */
+  u8 fixed_buffers : 1;
+  /* kernel thread polls submission queue, no syscall to submit */
+  u8 sqpoll : 1;
+  /* cpu that sqpoll thread is pinned to, -1 lets scheduler decide */
+  int sqpoll_cpu;
+  /* completion work only runs when loop asks for completions */
+  u8 defer_taskrun : 1;
+  /* print every event instead of gamepad state on every report */
+  u8 raw : 1;
+  /* shared memory object events and state are published to, or 0 */
+  const char *shm_name;
+  /* events in shared ring, power of 2 */
+  u32 shm_events;
+  /* compiled mapping file, or 0 */
+  const char *mappings_path;
+  /* with --compile-mappings, compile text database and exit */
+  const char *compile_input;
+  const char *compile_output;
+  struct subscription subscription;
+  /* log every device and event to this file, or 0 */
+  const char *record_path;
+  /* read devices from a record instead of /dev/input, or 0 */
+  const char *replay_path;
+  u8 replay_fast : 1;
+  /* write records instead of text lines, see struct output */
+  u8 binary : 1;
+  /* hotplug from kernel uevents instead of inotify on /dev/input */
+  u8 hotplug_netlink : 1;
+  /* file device cache is kept in across runs, or 0 */
+  const char *device_cache_path;
+};
+
+/* how long sqpoll thread spins without work before it goes to sleep */
+#define SQPOLL_IDLE_MS 1000
+
+/* how many devices can be used at the same time, ring is sized by it */
+#define DEVICE_MAX_DEFAULT 16
+#define DEVICE_MAX_LIMIT 1024
+/* index of registered buffer that spans all joystick ops */
+#define JOYSTICK_FIXED_BUFFER 0
+
+/*
+ * Provided buffer ring shared by all joystick multishot reads.
+ * Kernel picks a free buffer for each completion and reports its id in
+ * cqe->flags, buffer is given back after its events are processed.
+ * see: io_uring_register_buf_ring(3)
+ */
+#define JOYSTICK_BUFFER_GROUP 0
+#define JOYSTICK_BUFFER_COUNT_MIN 16
+
+struct joystick_buffer_ring {
+  struct io_uring_buf_ring *br;
+  struct input_event *events;
+  u32 events_per_buffer;
+  /* power of 2 */
+  u32 count;
 };
 
 struct memory_block {
@@ -76,38 +329,92 @@ struct memory_block {
   u64 total;
 };
 
+/*
+ * Fixed size pool. Free elements are linked through their first bytes,
+ * so push and pop are O(1).
+ * layout: [struct memory_chunk][used bitmap, debug only][elements]
+ */
 struct memory_chunk {
   void *block;
+  /* element size, rounded up to MEMORY_CHUNK_ALIGNMENT */
   u64 size;
   u64 max;
+  void *free;
+#ifndef NDEBUG
+  /* one bit per element, catches double free and foreign pointers */
+  u64 *used;
+#endif
 };
 
+#define MEMORY_CHUNK_ALIGNMENT 16
+
 #define KILOBYTES (1 << 10)
 #define MEGABYTES (1 << 20)
 #define GIGABYTES (1 << 30)
 
+static inline u64 align_up(u64 value, u64 alignment) {
+  return (value + alignment - 1) & ~(alignment - 1);
+}
+
+static inline u64 mem_chunk_element_size(u64 size) {
+  if (size < sizeof(void *))
+    size = sizeof(void *);
+  return align_up(size, MEMORY_CHUNK_ALIGNMENT);
+}
+
+/* offset of first element from start of chunk */
+static inline u64 mem_chunk_header_size(u64 max) {
+  u64 size = sizeof(struct memory_chunk);
+#ifndef NDEBUG
+  size += ((max + 63) / 64) * sizeof(u64);
+#else
+  (void)max;
+#endif
+  return align_up(size, MEMORY_CHUNK_ALIGNMENT);
+}
+
+static inline u64 mem_chunk_total(u64 size, u64 max) {
+  /* chunk itself may need padding to be aligned */
+  return MEMORY_CHUNK_ALIGNMENT - 1 + mem_chunk_header_size(max) +
+         max * mem_chunk_element_size(size);
+}
+
+static inline u64 mem_chunk_index(struct memory_chunk *chunk, void *block) {
+  return (u64)(block - chunk->block) / chunk->size;
+}
+
 static void *mem_chunk_push(struct memory_chunk *chunk) {
-  debug("mem_chunk_push\n");
-  void *result = 0;
-  void *dataBlock = chunk->block + sizeof(u8) * chunk->max;
-  for (u64 index = 0; index < chunk->max; index++) {
-    u8 *flag = chunk->block + sizeof(u8) * index;
-    if (*flag == 0) {
-      result = dataBlock + index * chunk->size;
-      *flag = 1;
-      return result;
-    }
-  }
+  void *result = chunk->free;
+  if (result == 0)
+    return 0;
+  chunk->free = *(void **)result;
+
+#ifndef NDEBUG
+  u64 index = mem_chunk_index(chunk, result);
+  u64 bit = (u64)1 << (index & 63);
+  assert(!(chunk->used[index >> 6] & bit));
+  chunk->used[index >> 6] |= bit;
+#endif
 
   return result;
 }
 
 static void mem_chunk_pop(struct memory_chunk *chunk, void *block) {
-  debug("mem_chunk_pop\n");
-  void *dataBlock = chunk->block + sizeof(u8) * chunk->max;
-  u64 index = (block - dataBlock) / chunk->size;
-  u8 *flag = chunk->block + sizeof(u8) * index;
-  *flag = 0;
+#ifndef NDEBUG
+  assert(block >= chunk->block &&
+         block < chunk->block + chunk->max * chunk->size &&
+         (u64)(block - chunk->block) % chunk->size == 0);
+  u64 index = mem_chunk_index(chunk, block);
+  u64 bit = (u64)1 << (index & 63);
+  if (!(chunk->used[index >> 6] & bit)) {
+    fatal("mem_chunk_pop: double free\n");
+    abort();
+  }
+  chunk->used[index >> 6] &= ~bit;
+#endif
+
+  *(void **)block = chunk->free;
+  chunk->free = block;
 }
 
 static void *mem_push(struct memory_block *mem, u64 size) {
@@ -117,338 +424,2656 @@ static void *mem_push(struct memory_block *mem, u64 size) {
   return result;
 }
 
+static void *mem_push_aligned(struct memory_block *mem, u64 size,
+                              u64 alignment) {
+  u64 address = (u64)mem->block + mem->used;
+  u64 padding = (alignment - (address & (alignment - 1))) & (alignment - 1);
+  assert(mem->used + padding <= mem->total);
+  mem->used += padding;
+  return mem_push(mem, size);
+}
+
 static struct memory_chunk *mem_push_chunk(struct memory_block *mem, u64 size,
                                            u64 max) {
-  struct memory_chunk *chunk =
-      mem_push(mem, sizeof(*chunk) + max * sizeof(u8) + max * size);
-  chunk->block = chunk + sizeof(*chunk);
-  chunk->size = size;
+  u64 headerSize = mem_chunk_header_size(max);
+  u64 elementSize = mem_chunk_element_size(size);
+  struct memory_chunk *chunk = mem_push_aligned(
+      mem, headerSize + max * elementSize, MEMORY_CHUNK_ALIGNMENT);
+  chunk->block = (void *)chunk + headerSize;
+  chunk->size = elementSize;
   chunk->max = max;
-  for (u64 index = 0; index < chunk->max; index++) {
-    u8 *flag = chunk->block + sizeof(u8) * index;
-    *flag = 0;
+
+#ifndef NDEBUG
+  chunk->used = (void *)(chunk + 1);
+  for (u64 index = 0; index < (max + 63) / 64; index++)
+    chunk->used[index] = 0;
+#endif
+
+  /* link in address order, so lowest free element is handed out first */
+  chunk->free = 0;
+  for (u64 index = max; index > 0; index--) {
+    void *element = chunk->block + (index - 1) * elementSize;
+    *(void **)element = chunk->free;
+    chunk->free = element;
   }
   return chunk;
 }
 
-static inline u8 libevdev_is_joystick(struct libevdev *evdev) {
-  return libevdev_has_event_type(evdev, EV_ABS) &&
-         libevdev_has_event_code(evdev, EV_ABS, ABS_HAT0X);
+static u8 string_equal(const char *a, const char *b) {
+  while (*a && *a == *b) {
+    a++;
+    b++;
+  }
+  return *a == *b;
 }
 
-static inline void PrintInfo(struct libevdev *evdev) {
-  int vendorId = libevdev_get_id_vendor(evdev);
-  int productId = libevdev_get_id_product(evdev);
-  printf("Input device name: \"%s\"\n", libevdev_get_name(evdev));
-  printf("Input device ID: bus %#x vendor %#x product %#x\n",
-         libevdev_get_id_bustype(evdev), vendorId, productId);
+/* Returns rest of string after prefix, or 0 when it does not start with it */
+static const char *string_prefix(const char *string, const char *prefix) {
+  while (*prefix && *string == *prefix) {
+    string++;
+    prefix++;
+  }
+  return *prefix ? 0 : string;
+}
 
-  enum ControllerType type = GuessControllerType(vendorId, productId);
+static u8 parse_u32(const char *string, u32 *value) {
+  u64 result = 0;
+  if (*string == 0)
+    return 0;
+  for (; *string; string++) {
+    if (*string < '0' || *string > '9')
+      return 0;
+    result = result * 10 + (u64)(*string - '0');
+    if (result > 0xffffffff)
+      return 0;
+  }
+  *value = (u32)result;
+  return 1;
+}
 
-  printf("xbox: %d\n", type == ControllerType_XBoxOneController ||
-                           type == ControllerType_XBox360Controller);
-  printf("ps: %d\n", type == ControllerType_PS3Controller ||
-                         type == ControllerType_PS4Controller ||
-                         type == ControllerType_PS5Controller);
+static u32 round_up_power_of_2(u32 value) {
+  u32 result = 1;
+  while (result < value)
+    result <<= 1;
+  return result;
 }
 
-int main(void) {
-  int error_code = 0;
+static inline void bit_set(u8 *bits, u32 index) {
+  bits[index / 8] |= (u8)(1 << (index % 8));
+}
 
-  struct io_uring ring;
-  if (io_uring_queue_init(4, &ring, 0)) {
-    error_code = GAMEPAD_ERROR_IO_URING_SETUP;
-    goto exit;
+static inline u8 bit_test(const u8 *bits, u32 index) {
+  return (bits[index / 8] >> (index % 8)) & 1;
+}
+
+/* Parses "bound", "all" or a list like "key,abs:0,abs:1,msc" */
+static u8 parse_subscription(const char *spec, struct subscription *sub) {
+  *sub = (struct subscription){};
+  if (string_equal(spec, "bound")) {
+    sub->mode = SUBSCRIBE_BOUND;
+    return 1;
+  }
+  if (string_equal(spec, "all")) {
+    sub->mode = SUBSCRIBE_ALL;
+    return 1;
   }
 
-  /* memory */
-  struct memory_block memory_block = {};
-  memory_block.total = 256 * KILOBYTES;
-  memory_block.block =
-      mmap(0, (size_t)memory_block.total, PROT_READ | PROT_WRITE,
-           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!memory_block.block) {
-    fatal("you do not have 256k memory available.\n");
-    error_code = GAMEPAD_ERROR_MEMORY;
-    goto io_uring_exit;
+  sub->mode = SUBSCRIBE_LIST;
+  while (*spec) {
+    char token[16];
+    u32 length = 0;
+    for (; *spec && *spec != ','; spec++) {
+      if (length + 1 == sizeof(token))
+        return 0;
+      token[length++] = *spec;
+    }
+    token[length] = 0;
+    if (*spec == ',')
+      spec++;
+
+    char *code = 0;
+    for (char *c = token; *c; c++) {
+      if (*c == ':') {
+        *c = 0;
+        code = c + 1;
+        break;
+      }
+    }
+
+    u8 *codes = 0;
+    u32 codeCount = 0;
+    u16 type;
+    if (string_equal(token, "key")) {
+      type = EV_KEY;
+      codes = sub->keys;
+      codeCount = KEY_CNT;
+    } else if (string_equal(token, "abs")) {
+      type = EV_ABS;
+      codes = sub->abs;
+      codeCount = ABS_CNT;
+    } else if (string_equal(token, "rel")) {
+      type = EV_REL;
+    } else if (string_equal(token, "msc")) {
+      type = EV_MSC;
+    } else if (string_equal(token, "sw")) {
+      type = EV_SW;
+    } else {
+      return 0;
+    }
+    bit_set(sub->types, type);
+
+    if (code == 0) {
+      for (u32 index = 0; index < codeCount; index++)
+        bit_set(codes, index);
+      continue;
+    }
+    u32 value;
+    if (codes == 0 || !parse_u32(code, &value) || value >= codeCount)
+      return 0;
+    bit_set(codes, value);
   }
+  return 1;
+}
 
-  struct memory_chunk *MemoryForEvents =
-      mem_push_chunk(&memory_block, sizeof(struct op), 40);
-  struct memory_chunk *MemoryForDeviceOpenEvents =
-      mem_push_chunk(&memory_block, sizeof(struct op_device_open), 10);
-  struct memory_chunk *MemoryForJoystickReadEvents =
-      mem_push_chunk(&memory_block, sizeof(struct op_joystick_read), 10);
-  printf("total memory usage: %llu\n", memory_block.used);
+static int parse_arguments(int argc, char *argv[], struct config *config) {
+  /* environment gives defaults, command line overrides them */
+  char *env = getenv("GAMEPAD_MAX_DEVICES");
+  if (env && (!parse_u32(env, &config->device_max) ||
+              config->device_max == 0 ||
+              config->device_max > DEVICE_MAX_LIMIT)) {
+    fatal("GAMEPAD_MAX_DEVICES must be between 1 and 1024\n");
+    return 0;
+  }
 
-  /* notify when a new input added */
-  int fd_inotify = inotify_init1(IN_NONBLOCK);
-  if (fd_inotify < 0) {
-    error_code = GAMEPAD_ERROR_INOTIFY_SETUP;
-    goto io_uring_exit;
+  for (int index = 1; index < argc; index++) {
+    char *arg = argv[index];
+    if (string_equal(arg, "--max-devices") && index + 1 < argc) {
+      u32 value;
+      if (!parse_u32(argv[++index], &value) || value == 0 ||
+          value > DEVICE_MAX_LIMIT) {
+        fatal("--max-devices must be between 1 and 1024\n");
+        return 0;
+      }
+      config->device_max = value;
+    } else if (string_equal(arg, "--events-per-read") && index + 1 < argc) {
+      u32 value;
+      if (!parse_u32(argv[++index], &value) || value == 0 ||
+          value > EVENTS_PER_READ_MAX) {
+        fatal("--events-per-read must be between 1 and 512\n");
+        return 0;
+      }
+      config->events_per_read = value;
+    } else if (string_equal(arg, "--no-multishot")) {
+      config->read_multishot = 0;
+    } else if (string_equal(arg, "--fixed")) {
+      config->fixed_files = 1;
+      config->fixed_buffers = 1;
+    } else if (string_equal(arg, "--shm") && index + 1 < argc) {
+      config->shm_name = argv[++index];
+      if (config->shm_name[0] != '/') {
+        fatal("--shm name must start with /\n");
+        return 0;
+      }
+    } else if (string_equal(arg, "--shm-events") && index + 1 < argc) {
+      u32 value;
+      if (!parse_u32(argv[++index], &value) || value < 2 ||
+          value > (1u << 24)) {
+        fatal("--shm-events must be between 2 and 16777216\n");
+        return 0;
+      }
+      config->shm_events = round_up_power_of_2(value);
+    } else if (string_equal(arg, "--mappings") && index + 1 < argc) {
+      config->mappings_path = argv[++index];
+    } else if (string_equal(arg, "--compile-mappings") && index + 2 < argc) {
+      config->compile_input = argv[++index];
+      config->compile_output = argv[++index];
+    } else if (string_equal(arg, "--subscribe") && index + 1 < argc) {
+      if (!parse_subscription(argv[++index], &config->subscription)) {
+        fatal("--subscribe takes bound, all or a list like key,abs:0,msc\n");
+        return 0;
+      }
+    } else if (string_equal(arg, "--record") && index + 1 < argc) {
+      config->record_path = argv[++index];
+    } else if (string_equal(arg, "--replay") && index + 1 < argc) {
+      config->replay_path = argv[++index];
+    } else if (string_equal(arg, "--replay-fast")) {
+      config->replay_fast = 1;
+    } else if (string_equal(arg, "--hotplug") && index + 1 < argc) {
+      char *source = argv[++index];
+      if (string_equal(source, "netlink")) {
+        config->hotplug_netlink = 1;
+      } else if (string_equal(source, "inotify")) {
+        config->hotplug_netlink = 0;
+      } else {
+        fatal("--hotplug must be inotify or netlink\n");
+        return 0;
+      }
+    } else if (string_equal(arg, "--device-cache") && index + 1 < argc) {
+      config->device_cache_path = argv[++index];
+    } else if (string_equal(arg, "--binary")) {
+      config->binary = 1;
+    } else if (string_equal(arg, "--raw")) {
+      config->raw = 1;
+    } else if (string_equal(arg, "--sqpoll")) {
+      config->sqpoll = 1;
+    } else if (string_equal(arg, "--sqpoll-cpu") && index + 1 < argc) {
+      u32 value;
+      if (!parse_u32(argv[++index], &value) || value > 0x7fffffff) {
+        fatal("--sqpoll-cpu must be a cpu number\n");
+        return 0;
+      }
+      config->sqpoll = 1;
+      config->sqpoll_cpu = (int)value;
+    } else {
+      fatal("usage: gamepad [--max-devices N] [--events-per-read N] "
+            "[--no-multishot] [--fixed] [--sqpoll] [--sqpoll-cpu N] "
+            "[--raw] [--shm NAME] [--shm-events N] [--mappings FILE] "
+            "[--compile-mappings IN OUT] [--subscribe SPEC] "
+            "[--record FILE] [--replay FILE] [--replay-fast] [--binary] "
+            "[--hotplug inotify|netlink] [--device-cache FILE]\n");
+      return 0;
+    }
+  }
+
+  /* raw output shows every event unless told otherwise */
+  if (config->subscription.mode == SUBSCRIBE_DEFAULT)
+    config->subscription.mode = config->raw ? SUBSCRIBE_ALL : SUBSCRIBE_BOUND;
+  return 1;
+}
+
+/* two buffers per device so one can be processed while other is filled */
+static inline u32 joystick_buffer_count(u32 device_max) {
+  u32 count = round_up_power_of_2(device_max * 2);
+  return count < JOYSTICK_BUFFER_COUNT_MIN ? JOYSTICK_BUFFER_COUNT_MIN : count;
+}
+
+static u8 joystick_buffer_ring_setup(struct io_uring *ring,
+                                     struct joystick_buffer_ring *jbr,
+                                     struct memory_block *mem,
+                                     u32 events_per_buffer, u32 count) {
+  u32 bufferSize = events_per_buffer * sizeof(struct input_event);
+  jbr->events_per_buffer = events_per_buffer;
+  jbr->count = count;
+  /* kernel wants the ring itself page aligned */
+  jbr->br =
+      mem_push_aligned(mem, count * sizeof(struct io_uring_buf), 4 * KILOBYTES);
+  jbr->events = mem_push(mem, count * bufferSize);
+
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (u64)jbr->br,
+      .ring_entries = count,
+      .bgid = JOYSTICK_BUFFER_GROUP,
+  };
+  if (io_uring_register_buf_ring(ring, &reg, 0))
+    return 0;
+
+  io_uring_buf_ring_init(jbr->br);
+  int mask = io_uring_buf_ring_mask(count);
+  for (u32 bid = 0; bid < count; bid++) {
+    io_uring_buf_ring_add(jbr->br, jbr->events + bid * events_per_buffer,
+                          bufferSize, (u16)bid, mask, (int)bid);
+  }
+  io_uring_buf_ring_advance(jbr->br, (int)count);
+  return 1;
+}
+
+static inline void joystick_buffer_recycle(struct joystick_buffer_ring *jbr,
+                                           u16 bid) {
+  io_uring_buf_ring_add(jbr->br, jbr->events + bid * jbr->events_per_buffer,
+                        jbr->events_per_buffer * sizeof(struct input_event),
+                        bid, io_uring_buf_ring_mask(jbr->count), 0);
+  io_uring_buf_ring_advance(jbr->br, 1);
+}
+
+/*
+ * io_uring_get_sqe() returns NULL when submission queue is full.
+ * Hand queued entries to kernel to make room and try again.
+ * Returns NULL only when kernel refuses to take any more work.
+ */
+static struct io_uring_sqe *get_sqe(struct io_uring *ring) {
+  struct io_uring_sqe *sqe = io_uring_get_sqe(ring);
+  while (sqe == 0) {
+    int submitted = io_uring_submit(ring);
+    /* entries are only freed after sqpoll thread consumes them */
+    if (submitted >= 0 && (ring->flags & IORING_SETUP_SQPOLL))
+      submitted = io_uring_sqring_wait(ring);
+    if (submitted < 0 ||
+        (submitted == 0 && io_uring_sq_space_left(ring) == 0)) {
+      warning("submission queue is full\n");
+      return 0;
+    }
+    sqe = io_uring_get_sqe(ring);
+  }
+  return sqe;
+}
+
+/* close in background, or right away when ring is out of space */
+static void close_fd(struct io_uring *ring, int fd) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0) {
+    close(fd);
+    return;
+  }
+  io_uring_prep_close(sqe, fd);
+  io_uring_sqe_set_data(sqe, 0);
+}
+
+/*
+ * Tries the fastest ring setup first and falls back to what kernel
+ * supports, config is updated to reflect the mode that is in use.
+ *   - sqpoll: kernel thread picks up submissions
+ *   - otherwise: only this thread touches the ring, so task work is
+ *     deferred until loop waits for completions (linux 6.1)
+ * Returns 0 on success.
+ */
+static int ring_setup(struct io_uring *ring, u32 entries,
+                      struct config *config) {
+  struct io_uring_params params;
+  int error;
+
+  if (config->sqpoll) {
+    params = (struct io_uring_params){
+        .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SQPOLL,
+        .cq_entries = entries * 4,
+        .sq_thread_idle = SQPOLL_IDLE_MS,
+    };
+    if (config->sqpoll_cpu >= 0) {
+      params.flags |= IORING_SETUP_SQ_AFF;
+      params.sq_thread_cpu = (u32)config->sqpoll_cpu;
+    }
+    error = io_uring_queue_init_params(entries, ring, &params);
+    if (!error)
+      return 0;
+
+    /*
+     * before linux 5.11 sqpoll needs CAP_SYS_ADMIN, and pinning fails
+     * with EINVAL for an offline cpu.
+     */
+    warning("sqpoll is not permitted, submitting with syscalls\n");
+    config->sqpoll = 0;
   }
 
-  int fd_watch =
-      inotify_add_watch(fd_inotify, "/dev/input", IN_CREATE | IN_DELETE);
-  if (fd_watch < 0) {
-    error_code = GAMEPAD_ERROR_INOTIFY_WATCH_SETUP;
-    goto inotify_exit;
+  params = (struct io_uring_params){
+      .flags = IORING_SETUP_CQSIZE | IORING_SETUP_SINGLE_ISSUER |
+               IORING_SETUP_DEFER_TASKRUN | IORING_SETUP_COOP_TASKRUN,
+      .cq_entries = entries * 4,
+  };
+  error = io_uring_queue_init_params(entries, ring, &params);
+  if (!error) {
+    config->defer_taskrun = 1;
+    return 0;
   }
 
-  struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-  struct op *op = mem_chunk_push(MemoryForEvents);
-  op->type = OP_INOTIFY_WATCH;
-  op->fd = fd_inotify;
-  io_uring_prep_poll_multishot(sqe, op->fd, POLLIN);
+  params = (struct io_uring_params){
+      .flags = IORING_SETUP_CQSIZE,
+      .cq_entries = entries * 4,
+  };
+  return io_uring_queue_init_params(entries, ring, &params);
+}
+
+/* Returns 0 when read cannot be queued */
+static inline u8 prep_joystick_read(struct io_uring *ring,
+                                    struct op_joystick_read *op,
+                                    struct config *config) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0)
+    return 0;
+  int fd = config->fixed_files ? (int)op->slot : op->fd;
+  u32 size = op->event_max * sizeof(*op->events);
+  op->multishot = config->read_multishot;
+  if (config->read_multishot)
+    io_uring_prep_read_multishot(sqe, fd, 0, 0, JOYSTICK_BUFFER_GROUP);
+  else if (config->fixed_buffers)
+    io_uring_prep_read_fixed(sqe, fd, op->events, size, 0,
+                             JOYSTICK_FIXED_BUFFER);
+  else
+    io_uring_prep_read(sqe, fd, op->events, size, 0);
+  if (config->fixed_files)
+    io_uring_sqe_set_flags(sqe, sqe->flags | IOSQE_FIXED_FILE);
   io_uring_sqe_set_data(sqe, op);
+  return 1;
+}
 
-  /* add already connected joysticks to queue */
+/* Maps whole file read only, returns 0 on failure */
+static void *map_file(const char *path, u64 *size) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+    return 0;
 
-  DIR *dir = opendir("/dev/input");
-  if (dir == 0) {
-    error_code = GAMEPAD_ERROR_DEV_INPUT_DIR_OPEN;
-    goto inotify_watch_exit;
+  struct stat stat;
+  if (fstat(fd, &stat) || stat.st_size == 0) {
+    close(fd);
+    return 0;
   }
+  void *data =
+      mmap(0, (size_t)stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+
+  *size = (u64)stat.st_size;
+  return data;
+}
 
-  struct dirent *dirent;
-  u32 dirent_max = 1024;
-  while (dirent_max--) {
-    errno = 0;
-    dirent = readdir(dir);
+/* Compiles gamecontrollerdb.txt to a file for --mappings */
+static int compile_mappings(const char *input, const char *output) {
+  u64 length;
+  const char *text = map_file(input, &length);
+  if (text == 0) {
+    fatal("cannot read mapping database\n");
+    return GAMEPAD_ERROR_MAPPINGS;
+  }
 
-    /* error occured */
-    if (errno != 0) {
-      error_code = GAMEPAD_ERROR_DEV_INPUT_DIR_READ;
-      closedir(dir);
-      goto inotify_watch_exit;
+  u64 lineCount = 1;
+  for (u64 index = 0; index < length; index++)
+    lineCount += text[index] == '\n';
+
+  u32 bucketCount;
+  u64 capacity = gamepad_mapping_compiled_size(lineCount, &bucketCount);
+  void *compiled = mmap(0, (size_t)capacity, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (compiled == MAP_FAILED) {
+    fatal("not enough memory available.\n");
+    return GAMEPAD_ERROR_MEMORY;
+  }
+  u64 size = gamepad_mapping_compile(text, length, bucketCount, compiled);
+
+  int fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    fatal("cannot create compiled mapping file\n");
+    return GAMEPAD_ERROR_MAPPINGS;
+  }
+  for (u64 written = 0; written < size;) {
+    ssize_t result =
+        write(fd, (char *)compiled + written, (size_t)(size - written));
+    if (result <= 0) {
+      fatal("cannot write compiled mapping file\n");
+      close(fd);
+      return GAMEPAD_ERROR_MAPPINGS;
     }
+    written += (u64)result;
+  }
+  close(fd);
+
+  printf("mappings: %u, size: %llu\n",
+         ((struct gamepad_mapping_file *)compiled)->count, size);
+  return 0;
+}
+
+/*
+ * Creates shared memory object and lays out gamepad_shm.h in it.
+ * Returns 0 on failure.
+ */
+static struct gamepad_shm_header *shm_setup(const char *name, u32 slot_max,
+                                            u32 event_count) {
+  struct memory_block shm = {};
+  shm.total = sizeof(struct gamepad_shm_header) +
+              slot_max * sizeof(struct gamepad_slot) +
+              event_count * sizeof(struct gamepad_shm_event) +
+              GAMEPAD_SHM_CONSUMER_MAX * sizeof(struct gamepad_shm_cursor) +
+              /* alignment */
+              4 * 64;
+
+  int fd = shm_open(name, O_CREAT | O_RDWR, 0660);
+  if (fd < 0)
+    return 0;
+  if (ftruncate(fd, (off_t)shm.total)) {
+    close(fd);
+    return 0;
+  }
+  shm.block = mmap(0, (size_t)shm.total, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   fd, 0);
+  close(fd);
+  if (shm.block == MAP_FAILED)
+    return 0;
+  /* object may be left over from a previous run */
+  memset(shm.block, 0, (size_t)shm.total);
+
+  struct gamepad_shm_header *header =
+      mem_push_aligned(&shm, sizeof(struct gamepad_shm_header), 64);
+  void *slots =
+      mem_push_aligned(&shm, slot_max * sizeof(struct gamepad_slot), 64);
+  void *events = mem_push_aligned(
+      &shm, event_count * sizeof(struct gamepad_shm_event), 64);
+  void *cursors = mem_push_aligned(
+      &shm, GAMEPAD_SHM_CONSUMER_MAX * sizeof(struct gamepad_shm_cursor), 64);
+
+  header->version = GAMEPAD_SHM_VERSION;
+  header->size = shm.total;
+  header->slot_max = slot_max;
+  header->event_mask = event_count - 1;
+  header->consumer_max = GAMEPAD_SHM_CONSUMER_MAX;
+  header->slots_offset = (u64)((char *)slots - (char *)header);
+  header->events_offset = (u64)((char *)events - (char *)header);
+  header->cursors_offset = (u64)((char *)cursors - (char *)header);
+  /* consumers wait for magic before they look at anything else */
+  __atomic_store_n(&header->magic, GAMEPAD_SHM_MAGIC, __ATOMIC_RELEASE);
+  return header;
+}
+
+#define RECORD_BUFFER_SIZE (64 * KILOBYTES)
+
+/* buffered writer of --record log */
+struct recorder {
+  int fd;
+  u8 *buffer;
+  u32 used;
+  u32 size;
+};
 
-    /* end of directory stream is reached */
-    if (dirent == 0)
+static void recorder_flush(struct recorder *recorder) {
+  for (u32 written = 0; written < recorder->used;) {
+    ssize_t result = write(recorder->fd, recorder->buffer + written,
+                           recorder->used - written);
+    if (result <= 0) {
+      warning("cannot write record, recording stopped\n");
+      close(recorder->fd);
+      recorder->fd = -1;
       break;
+    }
+    written += (u32)result;
+  }
+  recorder->used = 0;
+}
 
-    if (dirent->d_type != DT_CHR)
+static void recorder_append(struct recorder *recorder, const void *data,
+                            u32 size) {
+  const u8 *from = data;
+  while (size && recorder->fd >= 0) {
+    if (recorder->used == recorder->size)
+      recorder_flush(recorder);
+    u32 count = recorder->size - recorder->used;
+    if (count > size)
+      count = size;
+    memcpy(recorder->buffer + recorder->used, from, count);
+    recorder->used += count;
+    from += count;
+    size -= count;
+  }
+}
+
+static void recorder_entry(struct recorder *recorder, u16 kind, u32 slot,
+                           u32 size) {
+  struct record_entry entry = {
+      .kind = kind,
+      .slot = (u16)slot,
+      .size = size,
+  };
+  recorder_append(recorder, &entry, sizeof(entry));
+}
+
+/* What device looks like, attach must be zeroed */
+static void record_attach_fill(struct record_attach *attach,
+                               struct libevdev *evdev) {
+  const char *name = libevdev_get_name(evdev);
+  for (u32 index = 0; name && name[index] && index + 1 < RECORD_NAME_MAX;
+       index++)
+    attach->name[index] = name[index];
+  attach->bustype = (u16)libevdev_get_id_bustype(evdev);
+  attach->vendor = (u16)libevdev_get_id_vendor(evdev);
+  attach->product = (u16)libevdev_get_id_product(evdev);
+  attach->version = (u16)libevdev_get_id_version(evdev);
+  for (u32 code = 0; code < KEY_CNT; code++) {
+    if (libevdev_has_event_code(evdev, EV_KEY, code))
+      bit_set(attach->keys, code);
+  }
+  for (u32 code = 0; code < ABS_CNT; code++) {
+    const struct input_absinfo *absinfo = libevdev_get_abs_info(evdev, code);
+    if (absinfo == 0)
       continue;
+    bit_set(attach->abs, code);
+    attach->absinfo[code] = *absinfo;
+  }
+}
 
-    /* get full path */
-    char path[32] = "/dev/input/";
-    for (char *dest = path + 11, *src = dirent->d_name; *src; src++, dest++) {
-      *dest = *src;
+/*
+ * Returns libevdev device that looks like attach without an fd, for
+ * replay and device cache. Values are from when attach was filled.
+ */
+static struct libevdev *evdev_from_attach(const struct record_attach *attach) {
+  struct libevdev *evdev = libevdev_new();
+  if (evdev == 0)
+    return 0;
+  char name[RECORD_NAME_MAX];
+  memcpy(name, attach->name, sizeof(name));
+  name[RECORD_NAME_MAX - 1] = 0;
+  libevdev_set_name(evdev, name);
+  libevdev_set_id_bustype(evdev, attach->bustype);
+  libevdev_set_id_vendor(evdev, attach->vendor);
+  libevdev_set_id_product(evdev, attach->product);
+  libevdev_set_id_version(evdev, attach->version);
+  libevdev_enable_event_type(evdev, EV_KEY);
+  libevdev_enable_event_type(evdev, EV_ABS);
+  for (u32 code = 0; code < KEY_CNT; code++) {
+    if (bit_test(attach->keys, code))
+      libevdev_enable_event_code(evdev, EV_KEY, code, 0);
+  }
+  for (u32 code = 0; code < ABS_CNT; code++) {
+    if (bit_test(attach->abs, code))
+      libevdev_enable_event_code(evdev, EV_ABS, code, attach->absinfo + code);
+  }
+  return evdev;
+}
+
+static void recorder_attach(struct recorder *recorder, u32 slot,
+                            struct libevdev *evdev) {
+  struct record_attach attach = {};
+  record_attach_fill(&attach, evdev);
+
+  recorder_entry(recorder, RECORD_ATTACH, slot, sizeof(attach));
+  recorder_append(recorder, &attach, sizeof(attach));
+}
+
+static void recorder_events(struct recorder *recorder, u32 slot,
+                            const struct input_event *events, u32 count) {
+  recorder_entry(recorder, RECORD_EVENTS, slot,
+                 count * (u32)sizeof(struct record_event));
+  for (u32 index = 0; index < count; index++) {
+    struct record_event event = record_event_pack(events + index);
+    recorder_append(recorder, &event, sizeof(event));
+  }
+}
+
+/*
+ * Everything printed while the loop runs is formatted into one of two
+ * buffers and handed to the ring as a single write once per loop
+ * iteration. Lines go to the other buffer while a write is in flight.
+ * With --binary stdout only carries records, struct gamepad_state per
+ * report or struct gamepad_shm_event per event with --raw, and text lines
+ * go to stderr.
+ */
+#define OUTPUT_BUFFER_SIZE (256 * KILOBYTES)
+/* room reserved for one line */
+#define OUTPUT_LINE_MAX 512
+
+struct output {
+  u16 type;
+  /* buffer that is not current is being written */
+  u8 writing : 1;
+  u8 binary : 1;
+  /* -1 after a write failed */
+  int fd;
+  u32 current;
+  /* bytes of buffer in flight kernel has taken so far */
+  u32 written;
+  /* lines and records that did not fit */
+  u64 dropped;
+  /* sequence of event records */
+  u64 sequence;
+  struct output_buffer buffers[2];
+  /* with --binary, text line being formatted */
+  struct output_buffer text;
+};
+
+/* Queues write of current buffer unless one is in flight already */
+static void output_submit(struct io_uring *ring, struct output *output) {
+  struct output_buffer *buffer = output->buffers + output->current;
+  if (output->writing || buffer->used == 0)
+    return;
+  if (output->fd < 0) {
+    buffer->used = 0;
+    return;
+  }
+
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0)
+    return;
+  io_uring_prep_write(sqe, output->fd, buffer->data, buffer->used, (u64)-1);
+  io_uring_sqe_set_data(sqe, output);
+  output->writing = 1;
+  output->written = 0;
+  output->current ^= 1;
+}
+
+/* Returns buffer with room for size bytes, or 0 when they must be dropped */
+static struct output_buffer *output_reserve(struct io_uring *ring,
+                                            struct output *output, u32 size) {
+  struct output_buffer *buffer = output->buffers + output->current;
+  if (buffer->size - buffer->used >= size)
+    return buffer;
+
+  /* batch is full, write it early if the other buffer is free */
+  output_submit(ring, output);
+  buffer = output->buffers + output->current;
+  if (buffer->size - buffer->used >= size)
+    return buffer;
+  output->dropped++;
+  return 0;
+}
+
+/* Returns buffer a text line is formatted into, see output_text_end */
+static struct output_buffer *output_text(struct io_uring *ring,
+                                         struct output *output) {
+  if (output->binary) {
+    output->text.used = 0;
+    return &output->text;
+  }
+  return output_reserve(ring, output, OUTPUT_LINE_MAX);
+}
+
+static void output_text_end(struct output *output) {
+  /* text is rare next to records, it is not worth batching */
+  if (output->binary)
+    write(2, output->text.data, output->text.used);
+}
+
+static int handle_output(struct io_uring *ring, struct output *output,
+                         struct io_uring_cqe *cqe) {
+  struct output_buffer *buffer = output->buffers + (output->current ^ 1);
+  if (cqe->res <= 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+    warning("cannot write output, output stopped\n");
+    output->fd = -1;
+    goto done;
+  }
+
+  if (cqe->res > 0)
+    output->written += (u32)cqe->res;
+  /* pipe took part of it, write the rest */
+  if (output->written < buffer->used) {
+    struct io_uring_sqe *sqe = get_sqe(ring);
+    if (sqe == 0) {
+      output->dropped++;
+      goto done;
     }
+    io_uring_prep_write(sqe, output->fd, buffer->data + output->written,
+                        buffer->used - output->written, (u64)-1);
+    io_uring_sqe_set_data(sqe, output);
+    return 0;
+  }
+
+done:
+  buffer->used = 0;
+  output->writing = 0;
+  return 0;
+}
+
+/* Loop has stopped, waits for write in flight and writes the rest */
+static void output_finish(struct io_uring *ring, struct output *output) {
+  while (output->writing) {
+    int error = io_uring_submit_and_wait(ring, 1);
+    if (error < 0 && error != -EINTR)
+      break;
 
-    struct op_joystick_read stagedOp = {};
-    stagedOp.type = OP_JOYSTICK_READ,
+    struct io_uring_cqe *cqe;
+    u32 head;
+    u32 seen = 0;
+    io_uring_for_each_cqe(ring, head, cqe) {
+      seen++;
+      if (io_uring_cqe_get_data(cqe) == output)
+        handle_output(ring, output, cqe);
+    }
+    io_uring_cq_advance(ring, seen);
+  }
+
+  struct output_buffer *buffer = output->buffers + output->current;
+  for (u32 written = 0; output->fd >= 0 && written < buffer->used;) {
+    ssize_t result =
+        write(output->fd, buffer->data + written, buffer->used - written);
+    if (result <= 0)
+      break;
+    written += (u32)result;
+  }
+  buffer->used = 0;
+}
+
+/*
+ * Startup enumeration of /dev/input. Nodes are opened with openat through
+ * the ring, up to SCAN_OPEN_MAX at once, so a slow node does not hold up
+ * the rest. Every completed open queues the next node.
+ */
+#define SCAN_OPEN_MAX 16
+
+struct scan {
+  /* 0 once every node is queued */
+  DIR *dir;
+  u32 inflight;
+  u32 nodes;
+  u32 pads;
+  u8 done : 1;
+  u64 start_ns;
+  /* time spent telling what opened nodes are */
+  u64 probe_ns;
+  u32 probed;
+  /* joysticks found in device cache */
+  u32 cached;
+};
+
+/* everything completion handlers need to queue more work */
+struct context {
+  struct io_uring *ring;
+  struct config *config;
+  struct memory_chunk *MemoryForDeviceOpenEvents;
+  struct memory_chunk *MemoryForJoystickReadEvents;
+  struct joystick_buffer_ring *joystickBufferRing;
+  struct gamepad_table *gamepads;
+  /* shared memory events are published to, or 0 */
+  struct gamepad_shm_header *shm;
+  /* mmaped compiled mapping file, or 0 */
+  const struct gamepad_mapping_file *mappings;
+  /* event time to handling latency of every slot */
+  struct histogram *latency;
+  /* --record log, or 0 */
+  struct recorder *recorder;
+  /* --replay state, or 0 */
+  struct op_replay *replay;
+  struct output *output;
+  /* startup scan, or 0 */
+  struct scan *scan;
+  /* nodes being opened */
+  struct op_device_open *opening;
+  struct device_cache *devices;
+};
+
+static inline void gamepad_publish(struct context *context,
+                                   struct op_joystick_read *op) {
+  gamepad_table_publish(context->gamepads, op->slot, &op->gamepad.pending);
+}
+
+static void PrintGamepadState(struct context *context,
+                              struct gamepad_state *state) {
+  struct output *output = context->output;
+  if (output->binary) {
+    struct output_buffer *buffer =
+        output_reserve(context->ring, output, sizeof(*state));
+    if (buffer)
+      output_bytes(buffer, state, sizeof(*state));
+    return;
+  }
+
+  struct output_buffer *line =
+      output_reserve(context->ring, output, OUTPUT_LINE_MAX);
+  if (line == 0)
+    return;
+  output_string(line, "pad: ");
+  output_u64(line, state->slot);
+  output_string(line, " seq: ");
+  output_u64(line, state->sequence);
+  output_string(line, " time: ");
+  output_u64(line, state->timestamp);
+  output_string(line, " buttons: ");
+  output_hex(line, state->buttons);
+  output_string(line, " left: ");
+  output_fixed(line, state->axes[GAMEPAD_AXIS_LEFT_X], 3);
+  output_char(line, ' ');
+  output_fixed(line, state->axes[GAMEPAD_AXIS_LEFT_Y], 3);
+  output_string(line, " right: ");
+  output_fixed(line, state->axes[GAMEPAD_AXIS_RIGHT_X], 3);
+  output_char(line, ' ');
+  output_fixed(line, state->axes[GAMEPAD_AXIS_RIGHT_Y], 3);
+  output_string(line, " triggers: ");
+  output_fixed(line, state->triggers[GAMEPAD_TRIGGER_LEFT], 3);
+  output_char(line, ' ');
+  output_fixed(line, state->triggers[GAMEPAD_TRIGGER_RIGHT], 3);
+  output_string(line, " hat: ");
+  output_s64(line, state->hats[0][0]);
+  output_char(line, ' ');
+  output_s64(line, state->hats[0][1]);
+  output_string(line, " dropped: ");
+  output_u64(line, state->dropped);
+  output_char(line, '\n');
+}
 
-    stagedOp.fd = open(path, O_RDONLY | O_NONBLOCK);
-    if (stagedOp.fd < 0)
+static void PrintEvent(struct context *context, struct op_joystick_read *op,
+                       struct input_event *event) {
+  struct output *output = context->output;
+  if (output->binary) {
+    struct gamepad_shm_event record = {
+        .sequence = ++output->sequence,
+        .timestamp = (u64)event->input_event_sec * 1000000 +
+                     (u64)event->input_event_usec,
+        .slot = op->slot,
+        .type = event->type,
+        .code = event->code,
+        .value = event->value,
+    };
+    struct output_buffer *buffer =
+        output_reserve(context->ring, output, sizeof(record));
+    if (buffer)
+      output_bytes(buffer, &record, sizeof(record));
+    return;
+  }
+
+  struct output_buffer *line =
+      output_reserve(context->ring, output, OUTPUT_LINE_MAX);
+  if (line == 0)
+    return;
+  output_hex(line, (u64)op);
+  output_string(line, " fd: ");
+  output_s64(line, op->fd);
+  output_string(line, " time: ");
+  output_s64(line, event->input_event_sec);
+  output_char(line, '.');
+  output_s64(line, event->input_event_usec);
+  output_string(line, " type: ");
+  output_u64(line, event->type);
+  output_string(line, " code: ");
+  output_u64(line, event->code);
+  output_string(line, " value: ");
+  output_s64(line, event->value);
+  output_char(line, '\n');
+}
+
+/* Returns mapping of device, or 0 when it uses linux gamepad layout */
+static const struct gamepad_mapping *
+mapping_find(const struct gamepad_mapping_file *mappings,
+             struct libevdev *evdev) {
+  if (mappings == 0)
+    return 0;
+
+  u8 guid[16];
+  gamepad_mapping_guid(guid, (u16)libevdev_get_id_bustype(evdev),
+                       (u16)libevdev_get_id_vendor(evdev),
+                       (u16)libevdev_get_id_product(evdev),
+                       (u16)libevdev_get_id_version(evdev));
+  const struct gamepad_mapping *mapping = gamepad_mapping_find(mappings, guid);
+  if (mapping)
+    return mapping;
+
+  /* entries without version match every version */
+  gamepad_mapping_guid(guid, (u16)libevdev_get_id_bustype(evdev),
+                       (u16)libevdev_get_id_vendor(evdev),
+                       (u16)libevdev_get_id_product(evdev), 0);
+  return gamepad_mapping_find(mappings, guid);
+}
+
+/* Numbers codes of device the way SDL does, see gamepad_mapping_codes */
+static void mapping_codes(struct libevdev *evdev,
+                          struct gamepad_mapping_codes *codes) {
+  codes->button_count = 0;
+  for (u16 code = BTN_JOYSTICK; code < KEY_CNT; code++) {
+    if (libevdev_has_event_code(evdev, EV_KEY, code))
+      codes->buttons[codes->button_count++] = code;
+  }
+  for (u16 code = 0; code < BTN_JOYSTICK; code++) {
+    if (libevdev_has_event_code(evdev, EV_KEY, code))
+      codes->buttons[codes->button_count++] = code;
+  }
+
+  codes->axis_count = 0;
+  for (u16 code = 0; code < ABS_CNT; code++) {
+    if (code >= ABS_HAT0X && code <= ABS_HAT3Y)
       continue;
+    if (libevdev_has_event_code(evdev, EV_ABS, code))
+      codes->axes[codes->axis_count++] = code;
+  }
+
+  codes->hat_count = 0;
+  for (u16 code = ABS_HAT0X; code <= ABS_HAT3Y; code += 2) {
+    if (libevdev_has_event_code(evdev, EV_ABS, code) ||
+        libevdev_has_event_code(evdev, EV_ABS, code + 1))
+      codes->hats[codes->hat_count++] = code;
+  }
+}
+
+/*
+ * Takes bindings, ranges and current values of device, so state is right
+ * even before the first report arrives.
+ * Returns mapping device uses, or 0 for linux gamepad layout.
+ */
+static const struct gamepad_mapping *
+gamepad_state_init(struct op_joystick_read *op,
+                   struct libevdev *evdev,
+                   const struct gamepad_mapping_file *mappings) {
+  struct gamepad_device *device = &op->gamepad;
+  gamepad_device_init(device, op->slot);
+
+  const struct gamepad_mapping *mapping = mapping_find(mappings, evdev);
+  if (mapping) {
+    struct gamepad_mapping_codes codes;
+    mapping_codes(evdev, &codes);
+    gamepad_device_map(device, mapping, &codes);
+  }
 
-    struct libevdev *evdev;
-    int rc = libevdev_new_from_fd(stagedOp.fd, &evdev);
-    if (rc < 0) {
-      warning("libevdev failed\n");
-      close(stagedOp.fd);
-      if (evdev)
-        libevdev_free(evdev);
+  for (u16 code = 0; code < ABS_CNT; code++) {
+    const struct input_absinfo *absinfo = libevdev_get_abs_info(evdev, code);
+    if (absinfo == 0)
       continue;
+    gamepad_device_set_range(device, code, absinfo->minimum, absinfo->maximum);
+    struct input_event event = {
+        .type = EV_ABS, .code = code, .value = absinfo->value};
+    gamepad_device_update(device, &event);
+  }
+
+  for (u16 code = 0; code < KEY_CNT; code++) {
+    if (!libevdev_has_event_code(evdev, EV_KEY, code))
+      continue;
+    struct input_event event = {
+        .type = EV_KEY,
+        .code = code,
+        .value = libevdev_get_event_value(evdev, EV_KEY, code)};
+    gamepad_device_update(device, &event);
+  }
+  return mapping;
+}
+
+/*
+ * Puts device in its slot of the registered file table, so reads do not
+ * have to look up the fd on every submission.
+ * Returns 0 when device cannot be used.
+ */
+static u8 joystick_attach(struct context *context, struct op_joystick_read *op,
+                          struct libevdev *evdev) {
+  op->slot = (u32)mem_chunk_index(context->MemoryForJoystickReadEvents, op);
+  if (context->config->fixed_files &&
+      io_uring_register_files_update(context->ring, op->slot, &op->fd, 1) !=
+          1) {
+    warning("cannot register device file\n");
+    return 0;
+  }
+
+  const struct gamepad_mapping *mapping =
+      gamepad_state_init(op, evdev, context->mappings);
+  struct output *output = context->output;
+  struct output_buffer *line = mapping ? output_text(context->ring, output) : 0;
+  if (line) {
+    output_string(line, "mapping: ");
+    output_string_max(line, mapping->name, GAMEPAD_MAPPING_NAME_MAX);
+    output_char(line, '\n');
+    output_text_end(output);
+  }
+
+  gamepad_publish(context, op);
+  histogram_reset(context->latency + op->slot);
+  return 1;
+}
+
+static void joystick_detach(struct context *context,
+                            struct op_joystick_read *op) {
+  if (context->config->fixed_files) {
+    int fd = -1;
+    io_uring_register_files_update(context->ring, op->slot, &fd, 1);
+  }
+
+  op->gamepad.pending.connected = 0;
+  op->gamepad.pending.sequence++;
+  gamepad_publish(context, op);
+
+  if (context->recorder)
+    recorder_entry(context->recorder, RECORD_DETACH, op->slot, 0);
+  if (context->replay)
+    context->replay->active--;
+
+  close_fd(context->ring, op->fd);
+  mem_chunk_pop(context->MemoryForJoystickReadEvents, op);
+}
+
+/*
+ * Reads whole key and abs state of device after kernel dropped events,
+ * only codes that are bound are applied.
+ */
+static void joystick_resync(struct op_joystick_read *op) {
+  struct gamepad_device *device = &op->gamepad;
+
+  u8 keys[KEY_CNT / 8] = {};
+  if (ioctl(op->fd, EVIOCGKEY(sizeof(keys)), keys) >= 0) {
+    for (u16 code = 0; code < KEY_CNT; code++) {
+      if (device->keys[code].target == GAMEPAD_TARGET_NONE)
+        continue;
+      struct input_event event = {
+          .type = EV_KEY, .code = code, .value = bit_test(keys, code)};
+      gamepad_device_update(device, &event);
     }
+  }
 
-    /* detect joystick */
-    if (!libevdev_is_joystick(evdev)) {
-      close(stagedOp.fd);
-      libevdev_free(evdev);
+  for (u16 code = 0; code < ABS_CNT; code++) {
+    struct gamepad_abs_binding *binding = device->abs + code;
+    if (binding->full.target == GAMEPAD_TARGET_NONE &&
+        binding->negative.target == GAMEPAD_TARGET_NONE &&
+        binding->positive.target == GAMEPAD_TARGET_NONE)
+      continue;
+    struct input_absinfo absinfo;
+    if (ioctl(op->fd, EVIOCGABS(code), &absinfo) < 0)
       continue;
+    struct input_event event = {
+        .type = EV_ABS, .code = code, .value = absinfo.value};
+    gamepad_device_update(device, &event);
+  }
+}
+
+/*
+ * Installs kernel side filter on device, so events nobody reads never
+ * cross into userspace. EV_SYN is never filtered by kernel.
+ */
+static void joystick_subscribe(struct op_joystick_read *op,
+                               struct subscription *sub) {
+  u8 types[EV_CNT / 8] = {};
+  u8 keys[KEY_CNT / 8] = {};
+  u8 abs[ABS_CNT / 8] = {};
+
+  if (sub->mode == SUBSCRIBE_ALL) {
+    return;
+  } else if (sub->mode == SUBSCRIBE_LIST) {
+    memcpy(types, sub->types, sizeof(types));
+    memcpy(keys, sub->keys, sizeof(keys));
+    memcpy(abs, sub->abs, sizeof(abs));
+  } else {
+    struct gamepad_device *device = &op->gamepad;
+    bit_set(types, EV_KEY);
+    bit_set(types, EV_ABS);
+    for (u32 code = 0; code < KEY_CNT; code++) {
+      if (device->keys[code].target != GAMEPAD_TARGET_NONE)
+        bit_set(keys, code);
+    }
+    for (u32 code = 0; code < ABS_CNT; code++) {
+      struct gamepad_abs_binding *binding = device->abs + code;
+      if (binding->full.target != GAMEPAD_TARGET_NONE ||
+          binding->negative.target != GAMEPAD_TARGET_NONE ||
+          binding->positive.target != GAMEPAD_TARGET_NONE)
+        bit_set(abs, code);
     }
+  }
 
-    PrintInfo(evdev);
+  /* codes first, so nothing unwanted slips through between the calls */
+  struct input_mask masks[] = {
+      {.type = EV_KEY, .codes_size = sizeof(keys), .codes_ptr = (u64)keys},
+      {.type = EV_ABS, .codes_size = sizeof(abs), .codes_ptr = (u64)abs},
+      /* EV_SYN mask selects types */
+      {.type = EV_SYN, .codes_size = sizeof(types), .codes_ptr = (u64)types},
+  };
+  for (u32 index = 0; index < sizeof(masks) / sizeof(masks[0]); index++) {
+    if (ioctl(op->fd, EVIOCSMASK, masks + index)) {
+      warning("event mask is not supported, reading every event\n");
+      return;
+    }
+  }
+}
 
-    struct op_joystick_read *submitOp =
-        mem_chunk_push(MemoryForJoystickReadEvents);
-    *submitOp = stagedOp;
-    struct io_uring_sqe *sqe = io_uring_get_sqe(&ring);
-    io_uring_prep_read(sqe, submitOp->fd, &submitOp->event,
-                       sizeof(submitOp->event), 0);
-    io_uring_sqe_set_data(sqe, submitOp);
+/*
+ * Starts reading from a device that passed device_is_joystick.
+ * Once it returns 1 device owns fd, joystick_detach closes it and clears
+ * its registered file slot, also when the first read cannot be queued.
+ * Returns 0 when device cannot be used, fd is not registered then and
+ * caller closes it.
+ */
+static u8 joystick_add(struct context *context, int fd,
+                       struct libevdev *evdev) {
+  struct op_joystick_read *op =
+      mem_chunk_push(context->MemoryForJoystickReadEvents);
+  if (op == 0) {
+    warning("too many devices, see --max-devices\n");
+    return 0;
+  }
+  op->type = OP_JOYSTICK_READ;
+  op->fd = fd;
+  op->event_max = context->config->events_per_read;
+
+  /*
+   * Event time on the clock we measure latency with. Kernel flushes
+   * queued events and queues SYN_DROPPED when clock changes, those are
+   * read away here and state is read back after attach.
+   */
+  int clock = CLOCK_MONOTONIC;
+  op->monotonic = ioctl(fd, EVIOCSCLOCKID, &clock) == 0;
+  if (op->monotonic) {
+    struct input_event discard[16];
+    while (read(fd, discard, sizeof(discard)) > 0)
+      ;
+  }
 
-    libevdev_free(evdev);
+  if (!joystick_attach(context, op, evdev)) {
+    mem_chunk_pop(context->MemoryForJoystickReadEvents, op);
+    return 0;
+  }
+  /*
+   * values libevdev read may be from before clock change, or from when
+   * device was cached
+   */
+  if (context->replay == 0) {
+    joystick_resync(op);
+    gamepad_publish(context, op);
   }
-  closedir(dir);
+  if (context->recorder)
+    recorder_attach(context->recorder, op->slot, evdev);
 
-  /* submit any work */
-  io_uring_submit(&ring);
+  /* replay pipes have no event mask */
+  if (context->replay == 0)
+    joystick_subscribe(op, &context->config->subscription);
 
-  /* event loop */
-  struct io_uring_cqe *cqe;
-  while (1) {
-    int error;
+  if (!context->config->raw)
+    PrintGamepadState(context, &op->gamepad.pending);
 
-  wait:
-    error = io_uring_wait_cqe(&ring, &cqe);
-    if (error) {
-      if (errno == EAGAIN)
-        goto wait;
-      fatal("io_uring\n");
-      error_code = GAMEPAD_ERROR_IO_URING_WAIT;
+  if (!prep_joystick_read(context->ring, op, context->config))
+    joystick_detach(context, op);
+  return 1;
+}
+
+static inline u64 clock_now_ns(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (u64)now.tv_sec * 1000000000 + (u64)now.tv_nsec;
+}
+
+static inline void process_joystick_events(struct context *context,
+                                           struct op_joystick_read *op,
+                                           struct input_event *events,
+                                           u32 count) {
+  struct histogram *latency = context->latency + op->slot;
+  u64 now = clock_now_ns(op->monotonic ? CLOCK_MONOTONIC : CLOCK_REALTIME);
+  if (context->recorder)
+    recorder_events(context->recorder, op->slot, events, count);
+
+  for (u32 index = 0; index < count; index++) {
+    struct input_event *event = events + index;
+    u64 time = (u64)event->input_event_sec * 1000000000 +
+               (u64)event->input_event_usec * 1000;
+    histogram_record(latency, now > time ? now - time : 0);
+    if (context->shm)
+      gamepad_shm_push(context->shm, op->slot, event);
+    if (context->config->raw)
+      PrintEvent(context, op, event);
+
+    u8 update = gamepad_device_update(&op->gamepad, event);
+    if (update == GAMEPAD_UPDATE_RESYNC) {
+      joystick_resync(op);
+      gamepad_device_commit(&op->gamepad, event);
+    }
+    if (update != GAMEPAD_UPDATE_NONE) {
+      gamepad_publish(context, op);
+      if (!context->config->raw)
+        PrintGamepadState(context, &op->gamepad.pending);
+    }
+  }
+}
+
+static inline void PrintInfo(struct context *context, struct libevdev *evdev,
+                             enum ControllerType type) {
+  struct output *output = context->output;
+  struct output_buffer *line = output_text(context->ring, output);
+  if (line == 0)
+    return;
+
+  int vendorId = libevdev_get_id_vendor(evdev);
+  int productId = libevdev_get_id_product(evdev);
+  const char *name = libevdev_get_name(evdev);
+  output_string(line, "Input device name: \"");
+  /* leave room for the lines below */
+  output_string_max(line, name ? name : "", OUTPUT_LINE_MAX / 2);
+  output_string(line, "\"\nInput device ID: bus ");
+  output_hex(line, (u32)libevdev_get_id_bustype(evdev));
+  output_string(line, " vendor ");
+  output_hex(line, (u32)vendorId);
+  output_string(line, " product ");
+  output_hex(line, (u32)productId);
+  output_char(line, '\n');
+
+  const char *controllerName = GuessControllerName(vendorId, productId);
+  if (controllerName) {
+    output_string(line, "Controller: \"");
+    output_string(line, controllerName);
+    output_string(line, "\"\n");
+  }
+
+  output_string(line, "xbox: ");
+  output_u64(line, type == ControllerType_XBoxOneController ||
+                       type == ControllerType_XBox360Controller);
+  output_string(line, "\nps: ");
+  output_u64(line, type == ControllerType_PS3Controller ||
+                       type == ControllerType_PS4Controller ||
+                       type == ControllerType_PS5Controller);
+  output_char(line, '\n');
+  output_text_end(output);
+}
+
+/*
+ * Whether device has ABS_HAT0X, from one ioctl into a bitmap on the
+ * stack, so keyboards, mice and nodes that are not evdev never get a
+ * libevdev context.
+ */
+static u8 device_is_joystick(int fd) {
+  u8 abs[ABS_CNT / 8] = {0};
+  if (ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(abs)), abs) < 0)
+    return 0;
+  return bit_test(abs, ABS_HAT0X);
+}
+
+/*
+ * Reads what device is cached by: its id, name, phys and uniq when it has
+ * them, and its key and abs bitmaps. Returns 0 when fd is not an evdev
+ * node.
+ */
+static u8 device_cache_key_read(int fd, struct device_cache_key *key) {
+  memset(key, 0, sizeof(*key));
+  struct input_id id;
+  if (ioctl(fd, EVIOCGID, &id))
+    return 0;
+  key->bustype = id.bustype;
+  key->vendor = id.vendor;
+  key->product = id.product;
+  key->version = id.version;
+  ioctl(fd, EVIOCGNAME(sizeof(key->name) - 1), key->name);
+  ioctl(fd, EVIOCGPHYS(sizeof(key->phys) - 1), key->phys);
+  ioctl(fd, EVIOCGUNIQ(sizeof(key->uniq) - 1), key->uniq);
+  if (ioctl(fd, EVIOCGBIT(EV_KEY, sizeof(key->keys)), key->keys) < 0 ||
+      ioctl(fd, EVIOCGBIT(EV_ABS, sizeof(key->abs)), key->abs) < 0)
+    return 0;
+  return 1;
+}
+
+/*
+ * Tells what device behind fd is, from device cache when it was seen
+ * before. Returns libevdev of a joystick and sets type, or 0 when device
+ * is not one.
+ */
+static struct libevdev *device_probe(struct context *context, int fd, u8 scan,
+                                     enum ControllerType *type) {
+  if (!device_is_joystick(fd)) {
+    if (!scan)
+      warning("This device does not look like a joystick\n");
+    return 0;
+  }
+
+  struct device_cache_key key;
+  if (!device_cache_key_read(fd, &key))
+    return 0;
+
+  /* rebuilt from cached capabilities instead of libevdev reading them */
+  struct device_cache_entry *entry = device_cache_find(context->devices, &key);
+  if (entry) {
+    if (scan)
+      context->scan->cached++;
+    *type = (enum ControllerType)entry->controller_type;
+    return evdev_from_attach(&entry->attach);
+  }
+
+  struct libevdev *evdev = 0;
+  int rc = libevdev_new_from_fd(fd, &evdev);
+  if (rc < 0) {
+    warning("libevdev failed\n");
+    return 0;
+  }
+
+  *type = GuessControllerType(key.vendor, key.product);
+  entry = device_cache_insert(context->devices, &key);
+  entry->controller_type = *type;
+  record_attach_fill(&entry->attach, evdev);
+  return evdev;
+}
+
+/*
+ * Maps device cache file, creates it or starts it over when it is not
+ * one. Returns 0 on failure.
+ */
+static struct device_cache *device_cache_map(const char *path) {
+  int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if (fd < 0)
+    return 0;
+
+  u64 size = device_cache_size(DEVICE_CACHE_COUNT);
+  struct stat st;
+  u8 fresh = fstat(fd, &st) || (u64)st.st_size != size;
+  if (fresh && ftruncate(fd, (off_t)size)) {
+    close(fd);
+    return 0;
+  }
+  struct device_cache *cache =
+      mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (cache == MAP_FAILED)
+    return 0;
+
+  if (fresh || !device_cache_valid(cache, size) ||
+      cache->count != DEVICE_CACHE_COUNT)
+    device_cache_init(cache, DEVICE_CACHE_COUNT);
+  return cache;
+}
+
+/* Returns node being opened that has given name in /dev/input, or 0 */
+static struct op_device_open *hotplug_find(struct context *context,
+                                           const char *name) {
+  for (struct op_device_open *op = context->opening; op; op = op->next) {
+    if (string_equal(op->path + 11, name))
+      return op;
+  }
+  return 0;
+}
+
+/* Returns new node in HOTPLUG_OPENING state, or 0 */
+static struct op_device_open *hotplug_push(struct context *context,
+                                           const char *name, u8 scan) {
+  struct op_device_open *op =
+      mem_chunk_push(context->MemoryForDeviceOpenEvents);
+  if (op == 0) {
+    warning("too many devices are being opened\n");
+    return 0;
+  }
+  memset(op, 0, sizeof(*op));
+  op->type = OP_DEVICE_OPEN;
+  op->scan = scan;
+  op->state = HOTPLUG_OPENING;
+
+  /* get full path */
+  char *dest = (char *)op->path;
+  for (const char *src = "/dev/input/"; *src; src++, dest++)
+    *dest = *src;
+  for (const char *src = name;
+       *src && dest < op->path + sizeof(op->path) - 1; src++, dest++)
+    *dest = *src;
+  *dest = 0;
+
+  op->start_ns = clock_now_ns(CLOCK_MONOTONIC);
+  op->next = context->opening;
+  context->opening = op;
+  return op;
+}
+
+static void hotplug_remove(struct context *context,
+                           struct op_device_open *op) {
+  struct op_device_open **link = &context->opening;
+  while (*link != op)
+    link = &(*link)->next;
+  *link = op->next;
+  mem_chunk_pop(context->MemoryForDeviceOpenEvents, op);
+}
+
+/* Returns 0 when open cannot be queued */
+static u8 hotplug_open(struct context *context, struct op_device_open *op) {
+  struct io_uring_sqe *sqe = get_sqe(context->ring);
+  if (sqe == 0)
+    return 0;
+  io_uring_prep_openat(sqe, AT_FDCWD, op->path, O_RDONLY | O_NONBLOCK, 0);
+  io_uring_sqe_set_data(sqe, op);
+  op->state = HOTPLUG_OPENING;
+  op->retry = 0;
+  return 1;
+}
+
+/* Returns 0 when retry cannot be queued */
+static u8 hotplug_wait(struct context *context, struct op_device_open *op) {
+  struct io_uring_sqe *sqe = get_sqe(context->ring);
+  if (sqe == 0)
+    return 0;
+  u64 ns = (u64)HOTPLUG_RETRY_NS << op->attempt++;
+  /* kernel reads timeout when it is submitted, so it lives in op */
+  op->timeout.tv_sec = (long long)(ns / 1000000000);
+  op->timeout.tv_nsec = (long long)(ns % 1000000000);
+  io_uring_prep_timeout(sqe, &op->timeout, 0, 0);
+  io_uring_sqe_set_data(sqe, op);
+  op->state = HOTPLUG_WAITING;
+  return 1;
+}
+
+/* Node in /dev/input changed, mask is IN_CREATE, IN_DELETE or IN_ATTRIB */
+static void hotplug_node(struct context *context, const char *name, u32 mask) {
+  struct op_device_open *op = hotplug_find(context, name);
+  if (mask & IN_CREATE) {
+    /* already being opened */
+    if (op)
+      return;
+    op = hotplug_push(context, name, 0);
+    if (op && !hotplug_open(context, op))
+      hotplug_remove(context, op);
+    return;
+  }
+
+  if (op == 0 || op->cancelled)
+    return;
+  if (mask & IN_DELETE) {
+    op->cancelled = 1;
+  } else if (mask & IN_ATTRIB) {
+    /* failed open in flight is retried when it completes */
+    if (op->retry || op->state == HOTPLUG_OPENING) {
+      op->retry = 1;
+      return;
+    }
+    op->retry = 1;
+  } else {
+    return;
+  }
+
+  /* op completes with ECANCELED, or its result if it was too late */
+  struct io_uring_sqe *sqe = get_sqe(context->ring);
+  if (sqe == 0)
+    return;
+  if (op->state == HOTPLUG_WAITING)
+    io_uring_prep_timeout_remove(sqe, (u64)op, 0);
+  else
+    io_uring_prep_cancel(sqe, op, 0);
+  io_uring_sqe_set_data(sqe, 0);
+}
+
+/* Handles one event of inotify watch on /dev/input */
+static void hotplug_event(struct context *context,
+                          struct inotify_event *event) {
+  if (event->len == 0 || (event->mask & IN_ISDIR))
+    return;
+
+  struct output_buffer *line = output_text(context->ring, context->output);
+  if (line) {
+    output_string(line, "--> ");
+    output_u64(line, event->mask);
+    output_char(line, ' ');
+    output_string(line, event->name);
+    output_string(line, " /dev/input/");
+    output_string(line, event->name);
+    output_char(line, '\n');
+    output_text_end(context->output);
+  }
+
+  if (string_prefix(event->name, "event"))
+    hotplug_node(context, event->name, event->mask);
+}
+
+/* Returns 0 when receive cannot be queued */
+static u8 prep_uevent_read(struct io_uring *ring, struct op_uevent *op) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0)
+    return 0;
+
+  /* multishot puts sender address in front of payload in the buffer */
+  op->msg = (struct msghdr){.msg_namelen = sizeof(op->name)};
+  if (op->multishot) {
+    io_uring_prep_recvmsg_multishot(sqe, op->fd, &op->msg, 0);
+    io_uring_sqe_set_flags(sqe, IOSQE_BUFFER_SELECT);
+    sqe->buf_group = UEVENT_BUFFER_GROUP;
+  } else {
+    op->iov = (struct iovec){.iov_base = op->buffers,
+                             .iov_len = UEVENT_BUFFER_SIZE};
+    op->msg.msg_name = &op->name;
+    op->msg.msg_iov = &op->iov;
+    op->msg.msg_iovlen = 1;
+    io_uring_prep_recvmsg(sqe, op->fd, &op->msg, 0);
+  }
+  io_uring_sqe_set_data(sqe, op);
+  return 1;
+}
+
+/* Returns whether last word of ABS= bitmap has ABS_HAT0X */
+static u8 uevent_abs_joystick(const char *abs) {
+  const char *word = abs;
+  for (const char *c = abs; *c; c++) {
+    if (*c == ' ')
+      word = c + 1;
+  }
+
+  u64 bits = 0;
+  for (; *word; word++) {
+    char c = *word;
+    u32 digit = c >= '0' && c <= '9'   ? (u32)(c - '0')
+                : c >= 'a' && c <= 'f' ? (u32)(c - 'a' + 10)
+                                       : 0;
+    bits = bits << 4 | digit;
+  }
+  return (bits >> ABS_HAT0X) & 1;
+}
+
+static void uevent_process(struct context *context, struct op_uevent *op,
+                           const char *data, u32 size) {
+  const char *action = 0;
+  const char *devpath = 0;
+  const char *subsystem = 0;
+  const char *devname = 0;
+  const char *product = 0;
+  const char *abs = 0;
+  for (u32 offset = 0; offset < size;) {
+    const char *field = data + offset;
+    u32 length = (u32)strnlen(field, size - offset);
+    /* last field is not terminated */
+    if (offset + length == size)
       break;
+    offset += length + 1;
+
+    const char *value;
+    if ((value = string_prefix(field, "ACTION=")))
+      action = value;
+    else if ((value = string_prefix(field, "DEVPATH=")))
+      devpath = value;
+    else if ((value = string_prefix(field, "SUBSYSTEM=")))
+      subsystem = value;
+    else if ((value = string_prefix(field, "DEVNAME=")))
+      devname = value;
+    else if ((value = string_prefix(field, "PRODUCT=")))
+      product = value;
+    else if ((value = string_prefix(field, "ABS=")))
+      abs = value;
+  }
+  if (!action || !devpath || !subsystem || !string_equal(subsystem, "input"))
+    return;
+  u8 add = string_equal(action, "add");
+
+  /* input device itself, remembered for its event node */
+  if (product) {
+    if (!add)
+      return;
+    struct uevent_parent *parent =
+        op->parents + op->parent_next++ % UEVENT_PARENT_MAX;
+    strncpy(parent->devpath, devpath, UEVENT_DEVPATH_MAX - 1);
+    parent->devpath[UEVENT_DEVPATH_MAX - 1] = 0;
+    strncpy(parent->product, product, UEVENT_PRODUCT_MAX - 1);
+    parent->product[UEVENT_PRODUCT_MAX - 1] = 0;
+    parent->joystick = abs && uevent_abs_joystick(abs);
+    return;
+  }
+
+  /* only event nodes are read, not js or mouse nodes */
+  const char *name = devname ? string_prefix(devname, "input/") : 0;
+  if (name == 0 || string_prefix(name, "event") == 0)
+    return;
+  if (string_equal(action, "remove")) {
+    hotplug_node(context, name, IN_DELETE);
+    return;
+  }
+  if (!add)
+    return;
+
+  /* devpath of event node is devpath of its input device + /eventN */
+  u32 parentLength = (u32)(strrchr(devpath, '/') - devpath);
+  struct uevent_parent *parent = 0;
+  for (u32 index = 0; index < UEVENT_PARENT_MAX; index++) {
+    struct uevent_parent *candidate = op->parents + index;
+    if (strlen(candidate->devpath) == parentLength &&
+        memcmp(candidate->devpath, devpath, parentLength) == 0)
+      parent = candidate;
+  }
+
+  struct output_buffer *line = output_text(context->ring, context->output);
+  if (line) {
+    output_string(line, "uevent: add ");
+    output_string(line, name);
+    if (parent) {
+      output_string(line, " product: ");
+      output_string(line, parent->product);
+      output_string(line, " joystick: ");
+      output_u64(line, parent->joystick);
     }
+    output_char(line, '\n');
+    output_text_end(context->output);
+  }
 
-    struct op *op = io_uring_cqe_get_data(cqe);
-    if (op == 0)
-      goto cqe_seen;
+  /* device is known not to be a joystick, do not touch it */
+  if (parent && !parent->joystick)
+    return;
+  hotplug_node(context, name, IN_CREATE);
+}
 
-    /* on inotify events */
-    if (op->type & OP_INOTIFY_WATCH) {
-      /* on error, finish the program */
-      if (cqe->res < 0) {
-        fatal("inotify watch\n");
-        error_code = GAMEPAD_ERROR_INOTIFY_WATCH;
-        break;
-      }
+/* Returns error code when program must finish */
+static int handle_uevent(struct context *context, struct op_uevent *op,
+                         struct io_uring_cqe *cqe) {
+  /* multishot recvmsg is available since linux 6.0 */
+  if (cqe->res == -EINVAL && op->multishot) {
+    warning("multishot recvmsg is not supported, receiving one uevent per "
+            "submission\n");
+    op->multishot = 0;
+    if (!prep_uevent_read(context->ring, op)) {
+      fatal("cannot receive uevents\n");
+      return GAMEPAD_ERROR_UEVENT;
+    }
+    return 0;
+  }
 
-      int revents = cqe->res;
-      if (!(revents & POLLIN)) {
-        fatal("inotify\n");
-        error_code = GAMEPAD_ERROR_INOTIFY_WATCH_POLL;
-        break;
-      }
+  /* ENOBUFS when buffers or socket ran out, uevents may be lost */
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -EINTR &&
+      cqe->res != -ENOBUFS) {
+    fatal("uevent\n");
+    return GAMEPAD_ERROR_UEVENT;
+  }
 
-      /*
-       * get the number of bytes available to read from an
-       * inotify file descriptor.
-       * see: inotify(7)
-       */
-      u32 bufsz;
-      ioctl(op->fd, FIONREAD, &bufsz);
-
-      u8 buf[bufsz];
-      ssize_t readBytes = read(op->fd, buf, sizeof(buf));
-      if (readBytes < 0) {
-        goto cqe_seen;
-      }
+  if (cqe->res >= 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+    u16 bid = (u16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    u8 *buffer = op->buffers + bid * UEVENT_BUFFER_SIZE;
+    struct io_uring_recvmsg_out *out =
+        io_uring_recvmsg_validate(buffer, cqe->res, &op->msg);
+    /* only kernel sends uevents, with port 0 */
+    if (out && !(out->flags & MSG_TRUNC) &&
+        out->namelen >= sizeof(struct sockaddr_nl) &&
+        ((struct sockaddr_nl *)io_uring_recvmsg_name(out))->nl_pid == 0)
+      uevent_process(context, op, io_uring_recvmsg_payload(out, &op->msg),
+                     io_uring_recvmsg_payload_length(out, cqe->res, &op->msg));
+    io_uring_buf_ring_add(op->br, buffer, UEVENT_BUFFER_SIZE, bid,
+                          io_uring_buf_ring_mask(UEVENT_BUFFER_COUNT), 0);
+    io_uring_buf_ring_advance(op->br, 1);
+  } else if (cqe->res >= 0 && !op->multishot && op->name.nl_pid == 0) {
+    uevent_process(context, op, (const char *)op->buffers, (u32)cqe->res);
+  }
 
-      struct inotify_event *event = (struct inotify_event *)buf;
-      if (event->len <= 0)
-        goto cqe_seen;
+  if (!(cqe->flags & IORING_CQE_F_MORE) &&
+      !prep_uevent_read(context->ring, op)) {
+    fatal("cannot receive uevents\n");
+    return GAMEPAD_ERROR_UEVENT;
+  }
+  return 0;
+}
 
-      if (event->mask & IN_ISDIR)
-        goto cqe_seen;
+/*
+ * Opens socket of kernel uevents and queues its receive.
+ * Returns 0 on failure.
+ */
+static u8 uevent_setup(struct io_uring *ring, struct op_uevent *op,
+                       struct memory_block *mem) {
+  op->type = OP_UEVENT;
+  op->fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+                  NETLINK_KOBJECT_UEVENT);
+  if (op->fd < 0)
+    return 0;
+  /* group 1 is kernel, udev rebroadcasts to group 2 in its own format */
+  struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = 1};
+  if (bind(op->fd, (struct sockaddr *)&addr, sizeof(addr)))
+    return 0;
+
+  op->br = mem_push_aligned(
+      mem, UEVENT_BUFFER_COUNT * sizeof(struct io_uring_buf), 4 * KILOBYTES);
+  op->buffers = mem_push(mem, UEVENT_BUFFER_COUNT * UEVENT_BUFFER_SIZE);
+  struct io_uring_buf_reg reg = {
+      .ring_addr = (u64)op->br,
+      .ring_entries = UEVENT_BUFFER_COUNT,
+      .bgid = UEVENT_BUFFER_GROUP,
+  };
+  op->multishot = io_uring_register_buf_ring(ring, &reg, 0) == 0;
+  if (op->multishot) {
+    io_uring_buf_ring_init(op->br);
+    int mask = io_uring_buf_ring_mask(UEVENT_BUFFER_COUNT);
+    for (u32 bid = 0; bid < UEVENT_BUFFER_COUNT; bid++)
+      io_uring_buf_ring_add(op->br, op->buffers + bid * UEVENT_BUFFER_SIZE,
+                            UEVENT_BUFFER_SIZE, (u16)bid, mask, (int)bid);
+    io_uring_buf_ring_advance(op->br, UEVENT_BUFFER_COUNT);
+  }
+  return prep_uevent_read(ring, op);
+}
 
-      /* get full path */
-      char path[32] = "/dev/input/";
-      for (char *dest = path + 11, *src = event->name; *src; src++, dest++) {
-        *dest = *src;
-      }
+/* Queues opens of next nodes, prints startup time once all are handled */
+static void scan_next(struct context *context) {
+  struct scan *scan = context->scan;
+  while (scan->dir && scan->inflight < SCAN_OPEN_MAX) {
+    errno = 0;
+    struct dirent *dirent = readdir(scan->dir);
+    if (dirent == 0) {
+      if (errno)
+        warning("cannot read /dev/input\n");
+      closedir(scan->dir);
+      scan->dir = 0;
+      break;
+    }
 
-      printf("--> %d %s %s\n", event->mask, event->name, path);
-
-      if (event->mask & IN_DELETE)
-        goto cqe_seen;
-
-      struct op_device_open *submitOp =
-          mem_chunk_push(MemoryForDeviceOpenEvents);
-      submitOp->type = OP_DEVICE_OPEN;
-      for (char *dest = (char *)submitOp->path, *src = path; *src;
-           src++, dest++)
-        *dest = *src;
-
-      /* wait for device initialization */
-      sqe = io_uring_get_sqe(&ring);
-      struct __kernel_timespec *ts = &(struct __kernel_timespec){
-          .tv_nsec = 75000000, /* 750ms */
-      };
-      io_uring_prep_timeout(sqe, ts, 1, 0);
-      io_uring_sqe_set_data(sqe, submitOp);
-      io_uring_submit(&ring);
-    }
-
-    else if (op->type & OP_DEVICE_OPEN) {
-      if (cqe->res < 0 && cqe->res != -ETIME) {
-        warning("waiting for device initialiation failed\n");
-        mem_chunk_pop(MemoryForDeviceOpenEvents, op);
-        goto cqe_seen;
-      }
+    /* js and mouse nodes duplicate an event node */
+    if (dirent->d_type != DT_CHR || !string_prefix(dirent->d_name, "event") ||
+        hotplug_find(context, dirent->d_name))
+      continue;
 
-      struct op_device_open *op = io_uring_cqe_get_data(cqe);
-      struct op_joystick_read stagedOp = {};
-      stagedOp.type = OP_JOYSTICK_READ;
-      stagedOp.fd = open(op->path, O_RDONLY | O_NONBLOCK);
-      mem_chunk_pop(MemoryForDeviceOpenEvents, op);
-      if (stagedOp.fd < 0) {
-        warning("opening device failed\n");
-        goto cqe_seen;
-      }
+    struct op_device_open *op = hotplug_push(context, dirent->d_name, 1);
+    if (op == 0 || !hotplug_open(context, op)) {
+      warning("cannot open more devices, scan stopped\n");
+      if (op)
+        hotplug_remove(context, op);
+      closedir(scan->dir);
+      scan->dir = 0;
+      break;
+    }
+    scan->inflight++;
+    scan->nodes++;
+  }
 
-      struct libevdev *evdev;
-      int rc = libevdev_new_from_fd(stagedOp.fd, &evdev);
-      if (rc < 0) {
-        warning("libevdev failed\n");
-        goto error;
-      }
+  if (scan->done || scan->dir || scan->inflight)
+    return;
+  scan->done = 1;
+  struct output_buffer *line = output_text(context->ring, context->output);
+  if (line == 0)
+    return;
+  output_string(line, "startup: nodes: ");
+  output_u64(line, scan->nodes);
+  output_string(line, " pads: ");
+  output_u64(line, scan->pads);
+  output_string(line, " time: ");
+  output_fixed(line,
+               (clock_now_ns(CLOCK_MONOTONIC) - scan->start_ns) / 1000000.0,
+               3);
+  output_string(line, "ms probe: ");
+  output_fixed(line,
+               scan->probed ? scan->probe_ns / 1000.0 / scan->probed : 0.0, 1);
+  output_string(line, "us/node cached: ");
+  output_u64(line, scan->cached);
+  output_char(line, '\n');
+  output_text_end(context->output);
+}
+
+/* Counts pad found by startup scan, time to the first one is printed */
+static void scan_pad_ready(struct context *context) {
+  struct scan *scan = context->scan;
+  if (scan->pads++)
+    return;
+  struct output_buffer *line = output_text(context->ring, context->output);
+  if (line == 0)
+    return;
+  output_string(line, "startup: first pad ready: ");
+  output_fixed(line,
+               (clock_now_ns(CLOCK_MONOTONIC) - scan->start_ns) / 1000000.0,
+               3);
+  output_string(line, "ms\n");
+  output_text_end(context->output);
+}
+
+/* Returns 0 when read cannot be queued */
+static u8 prep_inotify_read(struct io_uring *ring, struct op_inotify *op) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0)
+    return 0;
+  io_uring_prep_read(sqe, op->fd, op->buffer, sizeof(op->buffer), 0);
+  io_uring_sqe_set_data(sqe, op);
+  return 1;
+}
+
+/* Returns error code when program must finish */
+static int handle_inotify_watch(struct context *context, struct op_inotify *op,
+                                struct io_uring_cqe *cqe) {
+  /* on error, finish the program */
+  if (cqe->res < 0 && cqe->res != -EINTR && cqe->res != -EAGAIN) {
+    fatal("inotify watch\n");
+    return GAMEPAD_ERROR_INOTIFY_WATCH;
+  }
+
+  /*
+   * A hub with several pads reports all of them in one read, events are
+   * packed back to back with their names.
+   * see: inotify(7)
+   */
+  u32 size = cqe->res > 0 ? (u32)cqe->res : 0;
+  for (u32 offset = 0; offset + sizeof(struct inotify_event) <= size;) {
+    struct inotify_event *event = (struct inotify_event *)(op->buffer + offset);
+    offset += sizeof(*event) + event->len;
+    if (offset > size)
+      break;
+    if (event->mask & IN_Q_OVERFLOW)
+      warning("inotify queue overflowed, devices may be missed\n");
+    hotplug_event(context, event);
+  }
+
+  if (!prep_inotify_read(context->ring, op)) {
+    fatal("inotify watch\n");
+    return GAMEPAD_ERROR_INOTIFY_WATCH;
+  }
+  return 0;
+}
+
+static int handle_device_open(struct context *context,
+                              struct op_device_open *op,
+                              struct io_uring_cqe *cqe) {
+  struct io_uring *ring = context->ring;
+  u8 scan = op->scan;
+  struct libevdev *evdev = 0;
+
+  /* retry is due, or timeout was removed for IN_ATTRIB or IN_DELETE */
+  if (op->state == HOTPLUG_WAITING) {
+    if (op->cancelled || !hotplug_open(context, op))
+      hotplug_remove(context, op);
+    return 0;
+  }
+
+  int fd = cqe->res;
+  if (scan)
+    context->scan->inflight--;
+  if (op->cancelled) {
+    if (fd >= 0)
+      close_fd(ring, fd);
+    hotplug_remove(context, op);
+    goto done;
+  }
+
+  /* udev has not set permissions yet, or device is not registered yet */
+  if (!scan && (fd == -EACCES || fd == -ENODEV) &&
+      op->attempt < HOTPLUG_ATTEMPT_MAX) {
+    if (op->retry ? hotplug_open(context, op) : hotplug_wait(context, op))
+      return 0;
+  }
+
+  /* attach latency is from when node was reported to now */
+  u64 start_ns = op->start_ns;
+  u32 attempts = op->attempt + 1u;
+  hotplug_remove(context, op);
+  /* nodes scan cannot read are not ours, like keyboards */
+  if (fd < 0) {
+    if (!scan)
+      warning("opening device failed\n");
+    goto done;
+  }
+
+  enum ControllerType type;
+  u64 probeStart = clock_now_ns(CLOCK_MONOTONIC);
+  evdev = device_probe(context, fd, scan, &type);
+  if (scan) {
+    context->scan->probe_ns += clock_now_ns(CLOCK_MONOTONIC) - probeStart;
+    context->scan->probed++;
+  }
+  if (evdev == 0)
+    goto error;
+
+  PrintInfo(context, evdev, type);
+
+  if (!joystick_add(context, fd, evdev))
+    goto error;
+
+  libevdev_free(evdev);
+  if (scan) {
+    scan_pad_ready(context);
+    goto done;
+  }
+  struct output_buffer *line = output_text(ring, context->output);
+  if (line) {
+    output_string(line, "hotplug: attached in ");
+    output_fixed(line,
+                 (clock_now_ns(CLOCK_MONOTONIC) - start_ns) / 1000000.0, 3);
+    output_string(line, "ms attempts: ");
+    output_u64(line, attempts);
+    output_char(line, '\n');
+    output_text_end(context->output);
+  }
+  goto done;
+
+error:
+  if (evdev)
+    libevdev_free(evdev);
+  close_fd(ring, fd);
+
+done:
+  if (scan)
+    scan_next(context);
+  return 0;
+}
+
+static int handle_joystick_read(struct context *context,
+                                struct op_joystick_read *op,
+                                struct io_uring_cqe *cqe) {
+  struct io_uring *ring = context->ring;
+  struct config *config = context->config;
+
+  /* multishot read is available since linux 6.7 */
+  if (cqe->res == -EINVAL && op->multishot) {
+    if (config->read_multishot)
+      warning("multishot read is not supported, reading one batch per "
+              "submission\n");
+    config->read_multishot = 0;
+    if (!prep_joystick_read(ring, op, config))
+      joystick_detach(context, op);
+    return 0;
+  }
+
+  /*
+   * on joystick read error (eg. joystick removed), close the fd.
+   * ENOBUFS only means all provided buffers were in flight.
+   */
+  if (cqe->res < 0 && cqe->res != -EAGAIN && cqe->res != -ENOBUFS) {
+    warning("cannot read events from device. maybe disconnected?\n");
+    joystick_detach(context, op);
+    return 0;
+  }
+
+  /* evdev never ends a read with 0, replay pipe does when it is closed */
+  if (cqe->res == 0) {
+    joystick_detach(context, op);
+    return 0;
+  }
+
+  /*
+   * evdev only hands out whole events, so the kernel may have filled
+   * anything from one up to event_max events in a single read.
+   * see: "5. Event interface" in input.txt
+   */
+  u32 eventCount = cqe->res > 0 ? (u32)cqe->res / sizeof(*op->events) : 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    struct joystick_buffer_ring *jbr = context->joystickBufferRing;
+    u16 bid = (u16)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    process_joystick_events(context, op,
+                            jbr->events + bid * jbr->events_per_buffer,
+                            eventCount);
+    joystick_buffer_recycle(jbr, bid);
+  } else if (!op->multishot) {
+    process_joystick_events(context, op, op->events, eventCount);
+  }
+
+  /*
+   * multishot read stays armed until kernel says otherwise,
+   * single-shot read must be armed again after each batch.
+   */
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    if (!prep_joystick_read(ring, op, config))
+      joystick_detach(context, op);
+  }
+  return 0;
+}
+
+/* Creates a device that looks like recorded one and reads from a pipe */
+static void replay_attach(struct context *context, struct op_replay *replay,
+                          u16 slot, const struct record_attach *attach) {
+  if (slot >= replay->fd_max || replay->fds[slot] >= 0) {
+    warning("record has a bad device slot\n");
+    return;
+  }
+
+  /* io_uring waits for room in pipe, neither end needs O_NONBLOCK */
+  int fds[2];
+  if (pipe(fds)) {
+    warning("cannot create pipe for replay device\n");
+    return;
+  }
+
+  struct libevdev *evdev = evdev_from_attach(attach);
+  if (evdev == 0) {
+    close(fds[0]);
+    close(fds[1]);
+    return;
+  }
+
+  PrintInfo(context, evdev,
+            GuessControllerType(attach->vendor, attach->product));
+  if (joystick_add(context, fds[0], evdev)) {
+    replay->fds[slot] = fds[1];
+    replay->active++;
+  } else {
+    close(fds[0]);
+    close(fds[1]);
+  }
+  libevdev_free(evdev);
+}
+
+static void replay_finish(struct op_replay *replay) {
+  for (u32 slot = 0; slot < replay->fd_max; slot++) {
+    if (replay->fds[slot] >= 0)
+      close(replay->fds[slot]);
+    replay->fds[slot] = -1;
+  }
+  replay->done = 1;
+  replay->end_ns = clock_now_ns(CLOCK_MONOTONIC);
+}
 
-      /* detect joystick */
-      if (!libevdev_is_joystick(evdev)) {
-        warning("This device does not look like a joystick\n");
-        goto error;
+/*
+ * Plays entries until a write or timeout must be waited for.
+ * Completion of either comes back to handle_replay.
+ */
+static void replay_next(struct context *context, struct op_replay *replay) {
+  while (!replay->done) {
+    if (replay->pending_count) {
+      u64 now = clock_now_ns(CLOCK_MONOTONIC);
+      if (replay->start_ns == 0) {
+        replay->start_ns = now;
+        replay->first_time = replay->pending[0].time;
       }
 
-      PrintInfo(evdev);
-
-      struct op_joystick_read *submitOp =
-          mem_chunk_push(MemoryForJoystickReadEvents);
-      *submitOp = stagedOp;
-      sqe = io_uring_get_sqe(&ring);
-      io_uring_prep_read(sqe, submitOp->fd, &submitOp->event,
-                         sizeof(submitOp->event), 0);
-      io_uring_sqe_set_data(sqe, submitOp);
-      io_uring_submit(&ring);
-
-      libevdev_free(evdev);
-      goto cqe_seen;
-
-    error:
-      if (evdev)
-        libevdev_free(evdev);
-      sqe = io_uring_get_sqe(&ring);
-      io_uring_prep_close(sqe, stagedOp.fd);
-      io_uring_sqe_set_data(sqe, 0);
-      io_uring_submit(&ring);
-    }
-
-    else if (op->type & OP_JOYSTICK_READ) {
-      struct op_joystick_read *op = io_uring_cqe_get_data(cqe);
-      struct input_event *event = &op->event;
-
-      /* on joystick read error (eg. joystick removed), close the fd */
-      if (cqe->res < 0 && cqe->res != -EAGAIN) {
-        warning("cannot read events from device. maybe disconnected?\n");
-        sqe = io_uring_get_sqe(&ring);
-        io_uring_prep_close(sqe, op->fd);
-        io_uring_sqe_set_data(sqe, 0);
-        io_uring_submit(&ring);
-        mem_chunk_pop(MemoryForJoystickReadEvents, op);
-        goto cqe_seen;
+      /* original timing, wait until batch is due */
+      u64 due = replay->start_ns +
+                (replay->pending[0].time - replay->first_time) * 1000;
+      if (!replay->fast && !replay->waiting && due > now) {
+        struct io_uring_sqe *sqe = get_sqe(context->ring);
+        if (sqe == 0)
+          break;
+        replay->timeout.tv_sec = (long long)((due - now) / 1000000000);
+        replay->timeout.tv_nsec = (long long)((due - now) % 1000000000);
+        io_uring_prep_timeout(sqe, &replay->timeout, 0, 0);
+        io_uring_sqe_set_data(sqe, replay);
+        replay->waiting = 1;
+        return;
       }
+      replay->waiting = 0;
+
+      /* events get the time they are played at, so latency is real */
+      u32 count = replay->pending_count < REPLAY_WRITE_MAX
+                      ? replay->pending_count
+                      : (u32)REPLAY_WRITE_MAX;
+      u64 time = clock_now_ns(CLOCK_REALTIME) / 1000;
+      for (u32 index = 0; index < count; index++) {
+        const struct record_event *from = replay->pending + index;
+        struct input_event *to = replay->buffer + index;
+        to->input_event_sec = (long)(time / 1000000);
+        to->input_event_usec = (long)(time % 1000000);
+        to->type = from->type;
+        to->code = from->code;
+        to->value = from->value;
+      }
+      replay->pending += count;
+      replay->pending_count -= count;
+      replay->events += count;
+
+      int fd = replay->fds[replay->pending_slot];
+      if (fd < 0)
+        continue;
+      struct io_uring_sqe *sqe = get_sqe(context->ring);
+      if (sqe == 0)
+        break;
+      io_uring_prep_write(sqe, fd, replay->buffer,
+                          count * (u32)sizeof(struct input_event), (u64)-1);
+      io_uring_sqe_set_data(sqe, replay);
+      return;
+    }
 
-      printf("%p fd: %d time: %ld.%ld type: %d code: %d value: %d\n", op,
-             op->fd, event->input_event_sec, event->input_event_usec,
-             event->type, event->code, event->value);
+    if (replay->offset + sizeof(struct record_entry) > replay->size) {
+      replay_finish(replay);
+      return;
+    }
+    struct record_entry entry;
+    memcpy(&entry, replay->data + replay->offset, sizeof(entry));
+    const u8 *payload = replay->data + replay->offset + sizeof(entry);
+    replay->offset += sizeof(entry) + entry.size;
+    if (replay->offset > replay->size) {
+      warning("record is truncated\n");
+      replay_finish(replay);
+      return;
+    }
 
-      /* read event again from gamepad device */
-      sqe = io_uring_get_sqe(&ring);
-      io_uring_prep_read(sqe, op->fd, &op->event, sizeof(op->event), 0);
-      io_uring_sqe_set_data(sqe, op);
-      io_uring_submit(&ring);
+    if (entry.kind == RECORD_ATTACH &&
+        entry.size == sizeof(struct record_attach)) {
+      replay_attach(context, replay, entry.slot,
+                    (const struct record_attach *)payload);
+    } else if (entry.kind == RECORD_DETACH && entry.slot < replay->fd_max &&
+               replay->fds[entry.slot] >= 0) {
+      close(replay->fds[entry.slot]);
+      replay->fds[entry.slot] = -1;
+    } else if (entry.kind == RECORD_EVENTS && entry.slot < replay->fd_max) {
+      replay->pending = (const struct record_event *)payload;
+      replay->pending_count = entry.size / sizeof(struct record_event);
+      replay->pending_slot = entry.slot;
     }
+  }
+
+  warning("submission queue is full, replay stopped\n");
+  replay_finish(replay);
+}
 
-  cqe_seen:
-    io_uring_cqe_seen(&ring, cqe);
+static int handle_replay(struct context *context, struct op_replay *replay,
+                         struct io_uring_cqe *cqe) {
+  /* device was dropped, play the rest without it */
+  if (cqe->res == -EPIPE) {
+    close(replay->fds[replay->pending_slot]);
+    replay->fds[replay->pending_slot] = -1;
+    replay->pending_count = 0;
+  }
+
+  /* timeout ends with ETIME when it expires */
+  if (cqe->res < 0 && cqe->res != -ETIME && cqe->res != -EPIPE) {
+    warning("replay write failed\n");
+    replay_finish(replay);
+    return 0;
+  }
+  replay_next(context, replay);
+  return 0;
+}
+
+/* Prints latency of every slot that has seen events */
+static void PrintLatency(struct context *context) {
+  for (u32 slot = 0; slot < context->config->device_max; slot++) {
+    struct histogram *latency = context->latency + slot;
+    if (latency->count == 0)
+      continue;
+    struct output_buffer *line = output_text(context->ring, context->output);
+    if (line == 0)
+      return;
+    output_string(line, "latency pad: ");
+    output_u64(line, slot);
+    output_string(line, " events: ");
+    output_u64(line, latency->count);
+    output_string(line, " p50: ");
+    output_fixed(line, histogram_percentile(latency, 500000) / 1000.0, 1);
+    output_string(line, "us p99: ");
+    output_fixed(line, histogram_percentile(latency, 990000) / 1000.0, 1);
+    output_string(line, "us p99.9: ");
+    output_fixed(line, histogram_percentile(latency, 999000) / 1000.0, 1);
+    output_string(line, "us max: ");
+    output_fixed(line, latency->max / 1000.0, 1);
+    output_string(line, "us\n");
+    output_text_end(context->output);
+  }
+}
+
+static u8 prep_signal_read(struct io_uring *ring, struct op_signal *op) {
+  struct io_uring_sqe *sqe = get_sqe(ring);
+  if (sqe == 0)
+    return 0;
+  io_uring_prep_read(sqe, op->fd, &op->info, sizeof(op->info), 0);
+  io_uring_sqe_set_data(sqe, op);
+  return 1;
+}
+
+static int handle_signal(struct context *context, struct op_signal *op,
+                         struct io_uring_cqe *cqe) {
+  if (cqe->res == sizeof(op->info)) {
+    /* loop prints latency when it stops */
+    if (op->info.ssi_signo != SIGUSR1)
+      return GAMEPAD_STOP;
+    PrintLatency(context);
+  }
+
+  if (!prep_signal_read(context->ring, op))
+    warning("cannot wait for signals anymore\n");
+  return 0;
+}
+
+static int handle_cqe(struct context *context, struct io_uring_cqe *cqe) {
+  struct op *op = io_uring_cqe_get_data(cqe);
+  if (op == 0)
+    return 0;
+
+  /* on inotify events */
+  if (op->type & OP_INOTIFY_WATCH)
+    return handle_inotify_watch(context, (struct op_inotify *)op, cqe);
+  else if (op->type & OP_DEVICE_OPEN)
+    return handle_device_open(context, (struct op_device_open *)op, cqe);
+  else if (op->type & OP_JOYSTICK_READ)
+    return handle_joystick_read(context, (struct op_joystick_read *)op, cqe);
+  else if (op->type & OP_SIGNAL)
+    return handle_signal(context, (struct op_signal *)op, cqe);
+  else if (op->type & OP_REPLAY)
+    return handle_replay(context, (struct op_replay *)op, cqe);
+  else if (op->type & OP_OUTPUT)
+    return handle_output(context->ring, (struct output *)op, cqe);
+  else if (op->type & OP_UEVENT)
+    return handle_uevent(context, (struct op_uevent *)op, cqe);
+
+  return 0;
+}
+
+/* Starts adding already connected joysticks, see struct scan */
+static int scan_devices(struct context *context) {
+  struct scan *scan = context->scan;
+  scan->dir = opendir("/dev/input");
+  if (scan->dir == 0)
+    return GAMEPAD_ERROR_DEV_INPUT_DIR_OPEN;
+
+  scan->start_ns = clock_now_ns(CLOCK_MONOTONIC);
+  scan_next(context);
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  int error_code = 0;
+
+  struct config config = {
+      .events_per_read = EVENTS_PER_READ_DEFAULT,
+      .device_max = DEVICE_MAX_DEFAULT,
+      .read_multishot = 1,
+      .sqpoll_cpu = -1,
+      .shm_events = GAMEPAD_SHM_EVENT_COUNT_DEFAULT,
+  };
+  if (!parse_arguments(argc, argv, &config)) {
+    error_code = GAMEPAD_ERROR_ARGUMENT;
+    goto exit;
+  }
+
+  if (config.compile_input) {
+    error_code = compile_mappings(config.compile_input, config.compile_output);
+    goto exit;
+  }
+
+  /* with --binary, stdout is kept for records and printf goes to stderr */
+  struct output output = {.type = OP_OUTPUT, .binary = config.binary, .fd = 1};
+  if (config.binary) {
+    output.fd = dup(1);
+    if (output.fd < 0 || dup2(2, 1) < 0) {
+      fatal("cannot set up binary output\n");
+      error_code = GAMEPAD_ERROR_ARGUMENT;
+      goto exit;
+    }
+  }
+
+  const struct gamepad_mapping_file *mappings = 0;
+  if (config.mappings_path) {
+    u64 size;
+    mappings = map_file(config.mappings_path, &size);
+    if (mappings == 0 || !gamepad_mapping_valid(mappings, size)) {
+      fatal("not a compiled mapping file, see --compile-mappings\n");
+      error_code = GAMEPAD_ERROR_MAPPINGS;
+      goto exit;
+    }
+    printf("mappings: %u\n", mappings->count);
+  }
+
+  /*
+   * At most in flight at the same time:
+   *   - inotify read or uevent receive
+   *   - signalfd read
+   *   - output write
+   *   - replay write or timeout
+   *   - for every device: read, plus close when it goes
+   *   - for every node being opened, device_max of them plus SCAN_OPEN_MAX
+   *     of the startup scan: open or retry timeout, plus the cancel or
+   *     timeout removal when it is deleted
+   * Completions can burst past that with multishot reads, so give
+   * completion queue more room than the default of twice the entries.
+   */
+  u32 ringEntries = round_up_power_of_2(
+      4 + config.device_max * 2 + (config.device_max + SCAN_OPEN_MAX) * 2);
+  struct io_uring ring;
+  if (ring_setup(&ring, ringEntries, &config)) {
+    error_code = GAMEPAD_ERROR_IO_URING_SETUP;
+    goto exit;
+  }
+
+  /* memory */
+  u32 joystickBufferCount = joystick_buffer_count(config.device_max);
+  u64 joystickOpSize = sizeof(struct op_joystick_read) +
+                       config.events_per_read * sizeof(struct input_event);
+  struct memory_block memory_block = {};
+  memory_block.total =
+      /* joystick buffer ring, aligned to page */
+      4 * KILOBYTES + joystickBufferCount * sizeof(struct io_uring_buf) +
+      joystickBufferCount * config.events_per_read *
+          sizeof(struct input_event) +
+      sizeof(struct op_inotify) +
+      mem_chunk_total(sizeof(struct op_device_open),
+                      config.device_max + SCAN_OPEN_MAX) +
+      mem_chunk_total(joystickOpSize, config.device_max) +
+      64 + config.device_max * sizeof(struct gamepad_slot) +
+      config.device_max * sizeof(struct histogram) + sizeof(struct op_signal) +
+      (config.record_path ? RECORD_BUFFER_SIZE : 0) +
+      (config.replay_path
+           ? sizeof(struct op_replay) + DEVICE_MAX_LIMIT * sizeof(int)
+           : 0) +
+      2 * OUTPUT_BUFFER_SIZE + OUTPUT_LINE_MAX +
+      device_cache_size(DEVICE_CACHE_COUNT) +
+      (config.hotplug_netlink
+           ? sizeof(struct op_uevent) + 4 * KILOBYTES +
+                 UEVENT_BUFFER_COUNT * sizeof(struct io_uring_buf) +
+                 UEVENT_BUFFER_COUNT * UEVENT_BUFFER_SIZE
+           : 0) +
+      /* slack */
+      4 * KILOBYTES;
+  memory_block.block =
+      mmap(0, (size_t)memory_block.total, PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (memory_block.block == MAP_FAILED) {
+    fatal("not enough memory available.\n");
+    error_code = GAMEPAD_ERROR_MEMORY;
+    goto io_uring_exit;
+  }
+
+  struct joystick_buffer_ring joystickBufferRing = {};
+  if (config.read_multishot &&
+      !joystick_buffer_ring_setup(&ring, &joystickBufferRing, &memory_block,
+                                  config.events_per_read,
+                                  joystickBufferCount)) {
+    warning("provided buffer rings are not supported, reading one batch per "
+            "submission\n");
+    config.read_multishot = 0;
+  }
+
+  struct op_inotify *inotifyOp =
+      mem_push_aligned(&memory_block, sizeof(struct op_inotify), 8);
+  struct memory_chunk *MemoryForDeviceOpenEvents =
+      mem_push_chunk(&memory_block, sizeof(struct op_device_open),
+                     config.device_max + SCAN_OPEN_MAX);
+  struct memory_chunk *MemoryForJoystickReadEvents =
+      mem_push_chunk(&memory_block, joystickOpSize, config.device_max);
+  struct gamepad_table gamepads = {
+      .slots = mem_push_aligned(&memory_block,
+                                config.device_max *
+                                    sizeof(struct gamepad_slot),
+                                64),
+      .max = config.device_max,
+  };
+  struct histogram *latency = mem_push_aligned(
+      &memory_block, config.device_max * sizeof(struct histogram), 8);
+  struct op_signal *signalOp =
+      mem_push_aligned(&memory_block, sizeof(struct op_signal), 8);
+  u8 *recordBuffer =
+      config.record_path ? mem_push(&memory_block, RECORD_BUFFER_SIZE) : 0;
+  struct op_replay *replayOp =
+      config.replay_path
+          ? mem_push_aligned(&memory_block,
+                             sizeof(struct op_replay) +
+                                 DEVICE_MAX_LIMIT * sizeof(int),
+                             8)
+          : 0;
+  for (u32 index = 0; index < 2; index++) {
+    output.buffers[index].data = mem_push(&memory_block, OUTPUT_BUFFER_SIZE);
+    output.buffers[index].size = OUTPUT_BUFFER_SIZE;
+  }
+  struct op_uevent *uevent =
+      config.hotplug_netlink && !config.replay_path
+          ? mem_push_aligned(&memory_block, sizeof(struct op_uevent), 8)
+          : 0;
+  struct device_cache *devices = mem_push_aligned(
+      &memory_block, device_cache_size(DEVICE_CACHE_COUNT), 8);
+  output.text.data = mem_push(&memory_block, OUTPUT_LINE_MAX);
+  output.text.size = OUTPUT_LINE_MAX;
+  printf("total memory usage: %llu\n", memory_block.used);
+
+  /* in memory unless it is kept in a file */
+  device_cache_init(devices, DEVICE_CACHE_COUNT);
+  if (config.device_cache_path) {
+    struct device_cache *mapped = device_cache_map(config.device_cache_path);
+    if (mapped)
+      devices = mapped;
+    else
+      warning("cannot map device cache file, cache is kept in memory\n");
+    printf("device cache: %s, devices: %u\n", config.device_cache_path,
+           devices->used);
+  }
+
+  /* with --shm, state table lives in shared memory instead */
+  struct gamepad_shm_header *shm = 0;
+  if (config.shm_name) {
+    shm = shm_setup(config.shm_name, config.device_max, config.shm_events);
+    if (shm == 0) {
+      fatal("cannot create shared memory\n");
+      error_code = GAMEPAD_ERROR_SHM;
+      goto io_uring_exit;
+    }
+    gamepads = gamepad_shm_table(shm);
+    printf("shared memory: %s, events: %u\n", config.shm_name,
+           config.shm_events);
+  }
+
+  if (config.fixed_files &&
+      io_uring_register_files_sparse(&ring, config.device_max)) {
+    warning("registered file table is not supported\n");
+    config.fixed_files = 0;
+  }
+
+  if (config.fixed_buffers) {
+    struct iovec iov = {
+        .iov_base = MemoryForJoystickReadEvents->block,
+        .iov_len = MemoryForJoystickReadEvents->max *
+                   MemoryForJoystickReadEvents->size,
+    };
+    if (io_uring_register_buffers(&ring, &iov, 1)) {
+      warning("registered buffers are not supported\n");
+      config.fixed_buffers = 0;
+    }
+  }
+
+  printf("ring entries: %u, max devices: %u\n", ring.sq.ring_entries,
+         config.device_max);
+  if (config.sqpoll && config.sqpoll_cpu >= 0)
+    printf("submit: sqpoll on cpu %d\n", config.sqpoll_cpu);
+  else if (config.sqpoll)
+    printf("submit: sqpoll\n");
+  else if (config.defer_taskrun)
+    printf("submit: syscall, deferred task run\n");
+  else
+    printf("submit: syscall\n");
+  printf("read: %s, files: %s, buffers: %s\n",
+         config.read_multishot ? "multishot" : "single",
+         config.fixed_files ? "fixed" : "plain",
+         config.read_multishot  ? "provided"
+         : config.fixed_buffers ? "fixed"
+                                : "plain");
+
+  /* notify when a new input added, replay has no hotplug */
+  int fd_inotify = -1;
+  int fd_watch = -1;
+  if (uevent) {
+    if (!uevent_setup(&ring, uevent, &memory_block)) {
+      fatal("cannot receive kernel uevents\n");
+      error_code = GAMEPAD_ERROR_UEVENT_SETUP;
+      goto inotify_exit;
+    }
+    printf("hotplug: netlink, uevents: %s\n",
+           uevent->multishot ? "multishot" : "single");
+  } else if (!config.replay_path) {
+    /* blocking, so ring waits for events instead of failing with EAGAIN */
+    fd_inotify = inotify_init1(IN_CLOEXEC);
+    if (fd_inotify < 0) {
+      error_code = GAMEPAD_ERROR_INOTIFY_SETUP;
+      goto shm_exit;
+    }
+
+    fd_watch =
+        inotify_add_watch(fd_inotify, "/dev/input",
+                          IN_CREATE | IN_DELETE | IN_ATTRIB);
+    if (fd_watch < 0) {
+      error_code = GAMEPAD_ERROR_INOTIFY_WATCH_SETUP;
+      goto inotify_exit;
+    }
+
+    inotifyOp->type = OP_INOTIFY_WATCH;
+    inotifyOp->fd = fd_inotify;
+    if (!prep_inotify_read(&ring, inotifyOp)) {
+      error_code = GAMEPAD_ERROR_INOTIFY_WATCH;
+      goto inotify_watch_exit;
+    }
+  }
+
+  struct recorder recorder = {.fd = -1};
+  if (config.record_path) {
+    recorder.fd = open(config.record_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (recorder.fd < 0) {
+      fatal("cannot create record file\n");
+      error_code = GAMEPAD_ERROR_RECORD;
+      goto inotify_watch_exit;
+    }
+    recorder.buffer = recordBuffer;
+    recorder.size = RECORD_BUFFER_SIZE;
+    struct record_header header = {
+        .magic = RECORD_MAGIC,
+        .version = RECORD_VERSION,
+    };
+    recorder_append(&recorder, &header, sizeof(header));
+  }
+
+  struct op_replay *replay = 0;
+  if (config.replay_path) {
+    u64 size;
+    const u8 *data = map_file(config.replay_path, &size);
+    struct record_header header = {};
+    if (data && size >= sizeof(header))
+      memcpy(&header, data, sizeof(header));
+    if (header.magic != RECORD_MAGIC || header.version != RECORD_VERSION) {
+      fatal("not a record file, see --record\n");
+      error_code = GAMEPAD_ERROR_REPLAY;
+      goto inotify_watch_exit;
+    }
+    replay = replayOp;
+    replay->type = OP_REPLAY;
+    replay->fast = config.replay_fast;
+    replay->data = data;
+    replay->size = size;
+    replay->offset = sizeof(header);
+    replay->fd_max = DEVICE_MAX_LIMIT;
+    for (u32 slot = 0; slot < replay->fd_max; slot++)
+      replay->fds[slot] = -1;
+    /* writes to a dropped device fail with EPIPE instead */
+    signal(SIGPIPE, SIG_IGN);
+  }
+
+  struct scan scan = {};
+  struct context context = {
+      .ring = &ring,
+      .config = &config,
+      .MemoryForDeviceOpenEvents = MemoryForDeviceOpenEvents,
+      .MemoryForJoystickReadEvents = MemoryForJoystickReadEvents,
+      .joystickBufferRing = &joystickBufferRing,
+      .gamepads = &gamepads,
+      .shm = shm,
+      .mappings = mappings,
+      .latency = latency,
+      .recorder = config.record_path ? &recorder : 0,
+      .replay = replay,
+      .output = &output,
+      .scan = replay ? 0 : &scan,
+      .devices = devices,
+  };
+
+  /* signals are read through the ring like everything else */
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals, SIGUSR1);
+  sigaddset(&signals, SIGINT);
+  sigaddset(&signals, SIGTERM);
+  signalOp->type = OP_SIGNAL;
+  signalOp->fd = -1;
+  /* blocking like inotify fd, so ring waits for a signal */
+  if (sigprocmask(SIG_BLOCK, &signals, 0) == 0)
+    signalOp->fd = signalfd(-1, &signals, SFD_CLOEXEC);
+  if (signalOp->fd < 0 || !prep_signal_read(&ring, signalOp)) {
+    warning("cannot wait for signals, latency is not printed\n");
+    sigprocmask(SIG_UNBLOCK, &signals, 0);
+  }
+
+  if (replay)
+    printf("replay: %s%s\n", config.replay_path,
+           replay->fast ? ", as fast as possible" : "");
+  /* from here on everything is printed through output */
+  fflush(stdout);
+
+  if (replay) {
+    replay_next(&context, replay);
+  } else {
+    error_code = scan_devices(&context);
+    if (error_code)
+      goto inotify_watch_exit;
+  }
+
+  /*
+   * event loop
+   * Work queued by handlers is submitted at once at the start of next
+   * iteration, in the same syscall that waits for completions.
+   */
+  while (1) {
+    int error = io_uring_submit_and_wait(&ring, 1);
+    /* interrupted, or completion queue must be drained first */
+    if (error < 0 && error != -EINTR && error != -EAGAIN && error != -EBUSY) {
+      fatal("io_uring\n");
+      error_code = GAMEPAD_ERROR_IO_URING_WAIT;
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    u32 head;
+    u32 seen = 0;
+    io_uring_for_each_cqe(&ring, head, cqe) {
+      seen++;
+      error_code = handle_cqe(&context, cqe);
+      if (error_code)
+        break;
+    }
+    io_uring_cq_advance(&ring, seen);
+    output_submit(&ring, &output);
+
+    /* replay ends when every device has read its pipe to the end */
+    if (replay && replay->done && replay->active == 0)
+      error_code = GAMEPAD_STOP;
+    if (error_code)
+      break;
+  }
+
+  PrintLatency(&context);
+  output_finish(&ring, &output);
+  if (output.dropped)
+    printf("output: dropped: %llu\n", output.dropped);
+  if (replay) {
+    double seconds = (double)(replay->end_ns - replay->start_ns) / 1e9;
+    printf("replay: events: %llu seconds: %.3f events/s: %.0f\n",
+           replay->events, seconds,
+           seconds > 0 ? (double)replay->events / seconds : 0.0);
+  }
+  if (scan.dir)
+    closedir(scan.dir);
+  if (recorder.fd >= 0) {
+    recorder_flush(&recorder);
+    close(recorder.fd);
   }
+  if (error_code == GAMEPAD_STOP)
+    error_code = 0;
+  if (signalOp->fd >= 0)
+    close(signalOp->fd);
 
 inotify_watch_exit:
-  close(fd_watch);
+  if (fd_watch >= 0)
+    close(fd_watch);
 
 inotify_exit:
-  close(fd_inotify);
+  if (fd_inotify >= 0)
+    close(fd_inotify);
+  if (uevent && uevent->fd >= 0)
+    close(uevent->fd);
+
+shm_exit:
+  if (shm)
+    shm_unlink(config.shm_name);
 
 io_uring_exit:
   io_uring_queue_exit(&ring);
@@ -0,0 +1,457 @@
+#ifndef MAPPING_H
+#define MAPPING_H
+
+/*
+ * SDL game controller mappings (gamecontrollerdb.txt).
+ *
+ * Text database is compiled once into a flat file that is used straight
+ * from mmap: a header, an open addressing table of mapping indices keyed
+ * by GUID hash, and fixed size mappings.
+ *
+ *   gamepad --compile-mappings gamecontrollerdb.txt mappings.bin
+ *   gamepad --mappings mappings.bin
+ *
+ * A mapping names SDL joystick inputs (b3, a2, h0.4), which are indices
+ * into the codes a device has. They are resolved to evdev codes once per
+ * device, see gamepad_device_map.
+ * see: https://github.com/mdqinc/SDL_GameControllerDB
+ */
+
+#include <stdint.h>
+
+#include "gamepad.h"
+
+#define GAMEPAD_MAPPING_MAGIC 0x50414d47 /* "GMAP" */
+#define GAMEPAD_MAPPING_VERSION 1
+#define GAMEPAD_MAPPING_NAME_MAX 64
+#define GAMEPAD_MAPPING_BIND_MAX 32
+#define GAMEPAD_MAPPING_EMPTY 0xffffffff
+
+/* SDL joystick input a bind reads */
+#define GAMEPAD_INPUT_BUTTON 1
+#define GAMEPAD_INPUT_AXIS 2
+#define GAMEPAD_INPUT_HAT 3
+
+/* input_flags of axis input, hat input keeps its direction mask there */
+#define GAMEPAD_INPUT_POSITIVE (1 << 0)
+#define GAMEPAD_INPUT_NEGATIVE (1 << 1)
+#define GAMEPAD_INPUT_INVERT (1 << 2)
+
+struct gamepad_mapping_bind {
+  uint8_t input;
+  uint8_t input_index;
+  uint8_t input_flags;
+  /* enum gamepad_target, index and GAMEPAD_BINDING_* flags */
+  uint8_t target;
+  uint8_t index;
+  uint8_t flags;
+};
+
+struct gamepad_mapping {
+  /* crc bytes are zeroed, see gamepad_mapping_key */
+  uint8_t guid[16];
+  char name[GAMEPAD_MAPPING_NAME_MAX];
+  uint32_t count;
+  struct gamepad_mapping_bind binds[GAMEPAD_MAPPING_BIND_MAX];
+};
+
+struct gamepad_mapping_file {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;
+  uint32_t count;
+  /* bucket count - 1, bucket count is power of 2 */
+  uint32_t bucket_mask;
+  /* from start of file */
+  uint64_t buckets_offset;
+  uint64_t mappings_offset;
+};
+
+/* SDL output names, same order as gamepad.h enums */
+static const char *const GamepadMappingButtons[GAMEPAD_BUTTON_COUNT] = {
+    "a",          "b",           "x",           "y",
+    "back",       "guide",       "start",       "leftstick",
+    "rightstick", "leftshoulder", "rightshoulder", "dpup",
+    "dpdown",     "dpleft",      "dpright",     "misc1",
+    "paddle1",    "paddle2",     "paddle3",     "paddle4",
+    "touchpad",
+};
+static const char *const GamepadMappingAxes[GAMEPAD_AXIS_COUNT] = {
+    "leftx", "lefty", "rightx", "righty"};
+static const char *const GamepadMappingTriggers[GAMEPAD_TRIGGER_COUNT] = {
+    "lefttrigger", "righttrigger"};
+
+/*
+ * Linux GUID layout of SDL: bus, crc of name, vendor, 0, product, 0,
+ * version, driver. crc was added by later SDL versions, it is ignored so
+ * that old and new entries match the same device.
+ */
+static inline void gamepad_mapping_key(uint8_t guid[16]) {
+  guid[2] = 0;
+  guid[3] = 0;
+}
+
+static inline void gamepad_mapping_guid(uint8_t guid[16], uint16_t bus,
+                                        uint16_t vendor, uint16_t product,
+                                        uint16_t version) {
+  uint16_t words[8] = {bus, 0, vendor, 0, product, 0, version, 0};
+  for (uint32_t index = 0; index < 8; index++) {
+    guid[index * 2] = (uint8_t)(words[index] & 0xff);
+    guid[index * 2 + 1] = (uint8_t)(words[index] >> 8);
+  }
+}
+
+/* FNV-1a */
+static inline uint32_t gamepad_mapping_hash(const uint8_t guid[16]) {
+  uint32_t hash = 2166136261u;
+  for (uint32_t index = 0; index < 16; index++) {
+    hash ^= guid[index];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static inline uint8_t gamepad_mapping_guid_equal(const uint8_t a[16],
+                                                 const uint8_t b[16]) {
+  uint8_t difference = 0;
+  for (uint32_t index = 0; index < 16; index++)
+    difference |= (uint8_t)(a[index] ^ b[index]);
+  return difference == 0;
+}
+
+static inline uint8_t gamepad_mapping_word_equal(const char *word,
+                                                 const char *end,
+                                                 const char *string) {
+  for (; word < end; word++, string++) {
+    if (*string != *word)
+      return 0;
+  }
+  return *string == 0;
+}
+
+static inline int32_t gamepad_mapping_hex(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+/* Returns 0 when text does not hold a decimal number below 256 */
+static inline uint8_t gamepad_mapping_index(const char *text, const char *end,
+                                            uint8_t *index) {
+  uint32_t value = 0;
+  if (text == end)
+    return 0;
+  for (; text < end; text++) {
+    if (*text < '0' || *text > '9')
+      return 0;
+    value = value * 10 + (uint32_t)(*text - '0');
+    if (value > 255)
+      return 0;
+  }
+  *index = (uint8_t)value;
+  return 1;
+}
+
+/* Parses output like "a", "+leftx", "lefttrigger" */
+static inline uint8_t gamepad_mapping_parse_output(
+    const char *text, const char *end, struct gamepad_mapping_bind *bind) {
+  if (text < end && (*text == '+' || *text == '-')) {
+    bind->flags |= GAMEPAD_BINDING_HALF;
+    if (*text == '-')
+      bind->flags |= GAMEPAD_BINDING_NEGATIVE;
+    text++;
+  }
+
+  for (uint8_t index = 0; index < GAMEPAD_BUTTON_COUNT; index++) {
+    if (gamepad_mapping_word_equal(text, end, GamepadMappingButtons[index])) {
+      bind->target = GAMEPAD_TARGET_BUTTON;
+      bind->index = index;
+      return 1;
+    }
+  }
+  for (uint8_t index = 0; index < GAMEPAD_AXIS_COUNT; index++) {
+    if (gamepad_mapping_word_equal(text, end, GamepadMappingAxes[index])) {
+      bind->target = GAMEPAD_TARGET_AXIS;
+      bind->index = index;
+      return 1;
+    }
+  }
+  for (uint8_t index = 0; index < GAMEPAD_TRIGGER_COUNT; index++) {
+    if (gamepad_mapping_word_equal(text, end, GamepadMappingTriggers[index])) {
+      bind->target = GAMEPAD_TARGET_TRIGGER;
+      bind->index = index;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Parses input like "b3", "a2", "-a2", "a5~", "h0.4" */
+static inline uint8_t gamepad_mapping_parse_input(
+    const char *text, const char *end, struct gamepad_mapping_bind *bind) {
+  if (text < end && (*text == '+' || *text == '-')) {
+    bind->input_flags |=
+        *text == '+' ? GAMEPAD_INPUT_POSITIVE : GAMEPAD_INPUT_NEGATIVE;
+    text++;
+  }
+  if (end > text && end[-1] == '~') {
+    bind->input_flags |= GAMEPAD_INPUT_INVERT;
+    end--;
+  }
+  if (text == end)
+    return 0;
+
+  char kind = *text++;
+  if (kind == 'b') {
+    bind->input = GAMEPAD_INPUT_BUTTON;
+    return gamepad_mapping_index(text, end, &bind->input_index);
+  }
+  if (kind == 'a') {
+    bind->input = GAMEPAD_INPUT_AXIS;
+    return gamepad_mapping_index(text, end, &bind->input_index);
+  }
+  if (kind == 'h') {
+    const char *dot = text;
+    while (dot < end && *dot != '.')
+      dot++;
+    uint8_t mask;
+    if (dot == end || !gamepad_mapping_index(text, dot, &bind->input_index) ||
+        !gamepad_mapping_index(dot + 1, end, &mask))
+      return 0;
+    bind->input = GAMEPAD_INPUT_HAT;
+    bind->input_flags = mask;
+    return 1;
+  }
+  return 0;
+}
+
+/*
+ * Parses one line of gamecontrollerdb.txt, line ends at end or newline.
+ * Returns 0 for comments, other platforms and malformed lines.
+ */
+static inline uint8_t gamepad_mapping_parse(const char *line, const char *end,
+                                            struct gamepad_mapping *mapping) {
+  *mapping = (struct gamepad_mapping){{0}};
+
+  /* guid */
+  if (end - line < 33 || line[32] != ',')
+    return 0;
+  for (uint32_t index = 0; index < 16; index++) {
+    int32_t high = gamepad_mapping_hex(line[index * 2]);
+    int32_t low = gamepad_mapping_hex(line[index * 2 + 1]);
+    if (high < 0 || low < 0)
+      return 0;
+    mapping->guid[index] = (uint8_t)(high << 4 | low);
+  }
+  gamepad_mapping_key(mapping->guid);
+  const char *field = line + 33;
+
+  /* name */
+  uint32_t length = 0;
+  for (; field < end && *field != ','; field++) {
+    if (length + 1 < GAMEPAD_MAPPING_NAME_MAX)
+      mapping->name[length++] = *field;
+  }
+
+  /* key:value pairs */
+  uint8_t onLinux = 1;
+  while (field < end && *field == ',') {
+    const char *key = ++field;
+    while (field < end && *field != ',' && *field != ':')
+      field++;
+    if (field == end || *field != ':')
+      break;
+    const char *keyEnd = field;
+    const char *value = ++field;
+    while (field < end && *field != ',')
+      field++;
+    const char *valueEnd = field;
+
+    if (gamepad_mapping_word_equal(key, keyEnd, "platform")) {
+      onLinux = gamepad_mapping_word_equal(value, valueEnd, "Linux");
+      continue;
+    }
+    if (mapping->count == GAMEPAD_MAPPING_BIND_MAX)
+      continue;
+
+    /* unknown outputs like crc or hint are skipped */
+    struct gamepad_mapping_bind *bind = mapping->binds + mapping->count;
+    *bind = (struct gamepad_mapping_bind){0};
+    if (gamepad_mapping_parse_output(key, keyEnd, bind) &&
+        gamepad_mapping_parse_input(value, valueEnd, bind))
+      mapping->count++;
+  }
+  return onLinux && mapping->count > 0;
+}
+
+static inline uint64_t gamepad_mapping_align(uint64_t value) {
+  return (value + 63) & ~(uint64_t)63;
+}
+
+/* Upper bound of compiled size for a text database with line_count lines */
+static inline uint64_t gamepad_mapping_compiled_size(uint64_t line_count,
+                                                     uint32_t *bucket_count) {
+  uint32_t buckets = 16;
+  while (buckets < line_count * 2)
+    buckets <<= 1;
+  *bucket_count = buckets;
+  return gamepad_mapping_align(sizeof(struct gamepad_mapping_file)) +
+         gamepad_mapping_align(buckets * sizeof(uint32_t)) +
+         line_count * sizeof(struct gamepad_mapping);
+}
+
+/*
+ * Compiles text database into out, which must hold
+ * gamepad_mapping_compiled_size bytes for the same line count and be
+ * zeroed. First mapping of a GUID wins, like in SDL.
+ * Returns size of compiled file.
+ */
+static inline uint64_t gamepad_mapping_compile(const char *text,
+                                               uint64_t length,
+                                               uint32_t bucket_count,
+                                               void *out) {
+  struct gamepad_mapping_file *file = out;
+  file->bucket_mask = bucket_count - 1;
+  file->buckets_offset =
+      gamepad_mapping_align(sizeof(struct gamepad_mapping_file));
+  file->mappings_offset = file->buckets_offset +
+                          gamepad_mapping_align(bucket_count * sizeof(uint32_t));
+  uint32_t *buckets = (uint32_t *)((char *)out + file->buckets_offset);
+  struct gamepad_mapping *mappings =
+      (struct gamepad_mapping *)((char *)out + file->mappings_offset);
+  for (uint32_t index = 0; index < bucket_count; index++)
+    buckets[index] = GAMEPAD_MAPPING_EMPTY;
+
+  const char *end = text + length;
+  for (const char *line = text; line < end;) {
+    const char *lineEnd = line;
+    while (lineEnd < end && *lineEnd != '\n')
+      lineEnd++;
+
+    struct gamepad_mapping *mapping = mappings + file->count;
+    if (gamepad_mapping_parse(line, lineEnd, mapping)) {
+      uint32_t bucket = gamepad_mapping_hash(mapping->guid) & file->bucket_mask;
+      while (buckets[bucket] != GAMEPAD_MAPPING_EMPTY &&
+             !gamepad_mapping_guid_equal(mappings[buckets[bucket]].guid,
+                                         mapping->guid))
+        bucket = (bucket + 1) & file->bucket_mask;
+      if (buckets[bucket] == GAMEPAD_MAPPING_EMPTY)
+        buckets[bucket] = file->count++;
+    }
+    line = lineEnd + 1;
+  }
+
+  file->size =
+      file->mappings_offset + file->count * sizeof(struct gamepad_mapping);
+  file->version = GAMEPAD_MAPPING_VERSION;
+  file->magic = GAMEPAD_MAPPING_MAGIC;
+  return file->size;
+}
+
+/* Returns 0 when data of given size is not a compiled mapping file */
+static inline uint8_t gamepad_mapping_valid(const void *data, uint64_t size) {
+  const struct gamepad_mapping_file *file = data;
+  return size >= sizeof(struct gamepad_mapping_file) &&
+         file->magic == GAMEPAD_MAPPING_MAGIC &&
+         file->version == GAMEPAD_MAPPING_VERSION && file->size <= size &&
+         file->buckets_offset +
+                 ((uint64_t)file->bucket_mask + 1) * sizeof(uint32_t) <=
+             file->mappings_offset &&
+         file->mappings_offset +
+                 (uint64_t)file->count * sizeof(struct gamepad_mapping) <=
+             file->size;
+}
+
+/* Returns mapping of guid, or 0 */
+static inline const struct gamepad_mapping *
+gamepad_mapping_find(const struct gamepad_mapping_file *file,
+                     const uint8_t guid[16]) {
+  uint8_t key[16];
+  for (uint32_t index = 0; index < 16; index++)
+    key[index] = guid[index];
+  gamepad_mapping_key(key);
+
+  const uint32_t *buckets =
+      (const uint32_t *)((const char *)file + file->buckets_offset);
+  const struct gamepad_mapping *mappings =
+      (const struct gamepad_mapping *)((const char *)file +
+                                       file->mappings_offset);
+  uint32_t bucket = gamepad_mapping_hash(key) & file->bucket_mask;
+  for (uint32_t probe = 0; probe <= file->bucket_mask; probe++) {
+    uint32_t index = buckets[bucket];
+    if (index == GAMEPAD_MAPPING_EMPTY || index >= file->count)
+      return 0;
+    if (gamepad_mapping_guid_equal(mappings[index].guid, key))
+      return mappings + index;
+    bucket = (bucket + 1) & file->bucket_mask;
+  }
+  return 0;
+}
+
+/*
+ * Codes of a device in the order SDL numbers them: buttons from
+ * BTN_JOYSTICK up then the ones below it, axes without hats, hats as
+ * their X code.
+ */
+struct gamepad_mapping_codes {
+  uint16_t buttons[KEY_CNT];
+  uint16_t axes[ABS_CNT];
+  uint16_t hats[GAMEPAD_HAT_COUNT];
+  uint32_t button_count;
+  uint32_t axis_count;
+  uint32_t hat_count;
+};
+
+/* Replaces default bindings of device with mapping */
+static inline void gamepad_device_map(struct gamepad_device *device,
+                                      const struct gamepad_mapping *mapping,
+                                      const struct gamepad_mapping_codes *codes) {
+  gamepad_device_unbind(device);
+
+  for (uint32_t index = 0; index < mapping->count; index++) {
+    const struct gamepad_mapping_bind *bind = mapping->binds + index;
+    struct gamepad_binding binding = {
+        .target = bind->target,
+        .index = bind->index,
+        .flags = bind->flags,
+    };
+
+    if (bind->input == GAMEPAD_INPUT_BUTTON) {
+      if (bind->input_index >= codes->button_count)
+        continue;
+      device->keys[codes->buttons[bind->input_index]] = binding;
+    } else if (bind->input == GAMEPAD_INPUT_AXIS) {
+      if (bind->input_index >= codes->axis_count)
+        continue;
+      struct gamepad_abs_binding *abs = device->abs + codes->axes[bind->input_index];
+      if (bind->input_flags & GAMEPAD_INPUT_INVERT)
+        binding.flags |= GAMEPAD_BINDING_INVERT;
+      if (bind->input_flags & GAMEPAD_INPUT_POSITIVE)
+        abs->positive = binding;
+      else if (bind->input_flags & GAMEPAD_INPUT_NEGATIVE)
+        abs->negative = binding;
+      else
+        abs->full = binding;
+    } else if (bind->input == GAMEPAD_INPUT_HAT) {
+      if (bind->input_index >= codes->hat_count)
+        continue;
+      /* 1 up, 2 right, 4 down, 8 left */
+      uint16_t code = codes->hats[bind->input_index];
+      uint8_t mask = bind->input_flags;
+      if (mask & 1)
+        device->abs[code + 1].negative = binding;
+      if (mask & 2)
+        device->abs[code].positive = binding;
+      if (mask & 4)
+        device->abs[code + 1].positive = binding;
+      if (mask & 8)
+        device->abs[code].negative = binding;
+    }
+  }
+}
+
+#endif /* MAPPING_H */
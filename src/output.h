@@ -0,0 +1,117 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+/*
+ * Formatting into a byte buffer without stdio.
+ *
+ * Every function appends to buffer and silently truncates when it is
+ * full, callers reserve room for a whole line up front so that does not
+ * happen in practice. Numbers are formatted the same as their printf
+ * counterparts: %llu, %lld, %#x and %.Nf.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+struct output_buffer {
+  uint8_t *data;
+  uint32_t used;
+  uint32_t size;
+};
+
+static inline void output_bytes(struct output_buffer *buffer, const void *data,
+                                uint32_t size) {
+  uint32_t room = buffer->size - buffer->used;
+  if (size > room)
+    size = room;
+  memcpy(buffer->data + buffer->used, data, size);
+  buffer->used += size;
+}
+
+static inline void output_char(struct output_buffer *buffer, char c) {
+  if (buffer->used < buffer->size)
+    buffer->data[buffer->used++] = (uint8_t)c;
+}
+
+static inline void output_string(struct output_buffer *buffer,
+                                 const char *string) {
+  output_bytes(buffer, string, (uint32_t)strlen(string));
+}
+
+/* at most max bytes of string, for names that may not be terminated */
+static inline void output_string_max(struct output_buffer *buffer,
+                                     const char *string, uint32_t max) {
+  uint32_t length = 0;
+  while (length < max && string[length])
+    length++;
+  output_bytes(buffer, string, length);
+}
+
+static inline void output_u64(struct output_buffer *buffer, uint64_t value) {
+  /* digits are written from the end */
+  char digits[20];
+  uint32_t index = sizeof(digits);
+  do {
+    digits[--index] = (char)('0' + value % 10);
+    value /= 10;
+  } while (value);
+  output_bytes(buffer, digits + index, sizeof(digits) - index);
+}
+
+static inline void output_s64(struct output_buffer *buffer, int64_t value) {
+  if (value < 0) {
+    output_char(buffer, '-');
+    output_u64(buffer, (uint64_t)0 - (uint64_t)value);
+    return;
+  }
+  output_u64(buffer, (uint64_t)value);
+}
+
+/* 0x prefix like %#x, except for 0 */
+static inline void output_hex(struct output_buffer *buffer, uint64_t value) {
+  if (value == 0) {
+    output_char(buffer, '0');
+    return;
+  }
+
+  char digits[18];
+  uint32_t index = sizeof(digits);
+  while (value) {
+    digits[--index] = "0123456789abcdef"[value & 0xf];
+    value >>= 4;
+  }
+  digits[--index] = 'x';
+  digits[--index] = '0';
+  output_bytes(buffer, digits + index, sizeof(digits) - index);
+}
+
+/* value rounded to given decimals, at most 9 */
+static inline void output_fixed(struct output_buffer *buffer, double value,
+                                uint32_t decimals) {
+  uint64_t scale = 1;
+  for (uint32_t index = 0; index < decimals; index++)
+    scale *= 10;
+
+  if (value < 0) {
+    value = -value;
+    output_char(buffer, '-');
+  }
+  /* printf prints -0.000 for small negative values too */
+  double exact = value * (double)scale;
+  uint64_t scaled = (uint64_t)exact;
+  /* ties go to even like printf */
+  double rest = exact - (double)scaled;
+  if (rest > 0.5 || (rest == 0.5 && (scaled & 1)))
+    scaled++;
+  output_u64(buffer, scaled / scale);
+  if (decimals == 0)
+    return;
+
+  output_char(buffer, '.');
+  uint64_t fraction = scaled % scale;
+  for (scale /= 10; scale > fraction && scale > 1; scale /= 10)
+    output_char(buffer, '0');
+  output_u64(buffer, fraction);
+}
+
+#endif /* OUTPUT_H */
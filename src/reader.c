@@ -0,0 +1,109 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+/*
+ * Example consumer of gamepad --shm.
+ * Follows event ring and prints events, then prints state of every
+ * connected gamepad once a second. Reading itself makes no syscalls.
+ *
+ *   gamepad --shm /gamepad &
+ *   gamepad-reader /gamepad
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gamepad_shm.h"
+
+#define fatal(str) write(2, "e: " str, 3 + sizeof(str) - 1)
+
+/* how long to sleep when ring is empty */
+#define IDLE_SLEEP_NS 1000000
+/* how many connected gamepads are printed */
+#define PRINT_PAD_MAX 16
+
+static volatile sig_atomic_t running = 1;
+
+static void stop(int signal) {
+  (void)signal;
+  running = 0;
+}
+
+int main(int argc, char *argv[]) {
+  const char *name = argc > 1 ? argv[1] : GAMEPAD_SHM_NAME_DEFAULT;
+
+  int fd = shm_open(name, O_RDWR, 0);
+  if (fd < 0) {
+    fatal("cannot open shared memory, is gamepad running with --shm?\n");
+    return 1;
+  }
+
+  off_t size = lseek(fd, 0, SEEK_END);
+  if (size < (off_t)sizeof(struct gamepad_shm_header)) {
+    fatal("shared memory is too small\n");
+    close(fd);
+    return 1;
+  }
+  struct gamepad_shm_header *header =
+      mmap(0, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (header == MAP_FAILED) {
+    fatal("cannot map shared memory\n");
+    return 1;
+  }
+
+  struct gamepad_shm_consumer consumer;
+  if (header->size > (uint64_t)size ||
+      !gamepad_shm_consumer_claim(header, &consumer, (int32_t)getpid())) {
+    fatal("shared memory is not ready or has no free cursor\n");
+    return 1;
+  }
+
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  struct gamepad_table table = gamepad_shm_table(header);
+  struct gamepad_state states[PRINT_PAD_MAX];
+  struct timespec idle = {.tv_nsec = IDLE_SLEEP_NS};
+  uint32_t idleCount = 0;
+
+  while (running) {
+    struct gamepad_shm_event event;
+    uint8_t any = 0;
+    while (gamepad_shm_next(&consumer, &event)) {
+      any = 1;
+      printf("pad: %u time: %llu type: %u code: %u value: %d\n", event.slot,
+             (unsigned long long)event.timestamp, event.type, event.code,
+             event.value);
+    }
+    if (any) {
+      fflush(stdout);
+      continue;
+    }
+
+    /* once a second without events */
+    if (++idleCount == 1000) {
+      idleCount = 0;
+      uint32_t count = gamepad_table_query(&table, states, PRINT_PAD_MAX);
+      for (uint32_t index = 0; index < count; index++)
+        printf("pad: %u seq: %llu buttons: %#x left: %.3f %.3f\n",
+               states[index].slot,
+               (unsigned long long)states[index].sequence,
+               states[index].buttons, states[index].axes[GAMEPAD_AXIS_LEFT_X],
+               states[index].axes[GAMEPAD_AXIS_LEFT_Y]);
+      if (consumer.cursor->dropped)
+        printf("dropped: %llu\n",
+               (unsigned long long)consumer.cursor->dropped);
+      fflush(stdout);
+    }
+    nanosleep(&idle, 0);
+  }
+
+  gamepad_shm_consumer_release(&consumer);
+  munmap(header, (size_t)size);
+  return 0;
+}
@@ -0,0 +1,73 @@
+#ifndef RECORD_H
+#define RECORD_H
+
+/*
+ * Log written by gamepad --record and played back by --replay.
+ *
+ * File starts with struct record_header, then entries follow back to back:
+ * struct record_entry and size bytes of payload. Devices are referred to
+ * by the slot they had while recording.
+ *
+ *   RECORD_ATTACH  struct record_attach, what device looked like
+ *   RECORD_EVENTS  struct record_event[], one read batch
+ *   RECORD_DETACH  no payload
+ */
+
+#include <linux/input.h>
+#include <stdint.h>
+
+#define RECORD_MAGIC 0x43455247 /* "GREC" */
+#define RECORD_VERSION 1
+
+#define RECORD_ATTACH 1
+#define RECORD_EVENTS 2
+#define RECORD_DETACH 3
+
+#define RECORD_NAME_MAX 64
+
+struct record_header {
+  uint32_t magic;
+  uint32_t version;
+};
+
+struct record_entry {
+  uint16_t kind;
+  uint16_t slot;
+  /* bytes of payload that follow */
+  uint32_t size;
+};
+
+struct record_attach {
+  char name[RECORD_NAME_MAX];
+  uint16_t bustype;
+  uint16_t vendor;
+  uint16_t product;
+  uint16_t version;
+  /* bitmaps of codes device has */
+  uint8_t keys[KEY_CNT / 8];
+  uint8_t abs[ABS_CNT / 8];
+  /* only valid for codes in abs */
+  struct input_absinfo absinfo[ABS_CNT];
+};
+
+/* input_event without the padding of struct timeval */
+struct record_event {
+  /* kernel time, in microseconds */
+  uint64_t time;
+  uint16_t type;
+  uint16_t code;
+  int32_t value;
+};
+
+static inline struct record_event record_event_pack(
+    const struct input_event *event) {
+  return (struct record_event){
+      .time = (uint64_t)event->input_event_sec * 1000000 +
+              (uint64_t)event->input_event_usec,
+      .type = event->type,
+      .code = event->code,
+      .value = event->value,
+  };
+}
+
+#endif /* RECORD_H */
@@ -0,0 +1,145 @@
+#define _DEFAULT_SOURCE
+#define _XOPEN_SOURCE 700
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "gamepad.h"
+
+/*
+ * Stress test of the slot seqlock of gamepad_table.
+ *
+ * One writer publishes to every slot as fast as it can, states whose
+ * fields are all derived from sequence, while reader threads copy them
+ * with gamepad_table_read and check that no copy is torn and that sequence
+ * of a slot never goes back. Exits with 1 when a check fails.
+ *
+ * usage: stress-seqlock [readers] [seconds]
+ */
+
+#define READER_MAX 64
+/* neighbouring slots, so writes to one must not disturb reads of another */
+#define SLOT_COUNT 4
+
+static struct gamepad_slot slots[SLOT_COUNT];
+static struct gamepad_table table = {.slots = slots, .max = SLOT_COUNT};
+static volatile int running = 1;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void state_fill(struct gamepad_state *state, uint32_t slot,
+                       uint64_t sequence) {
+  *state = (struct gamepad_state){
+      .sequence = sequence,
+      .timestamp = sequence * 3,
+      .slot = slot,
+      .buttons = (uint32_t)sequence ^ 0xa5a5a5a5u,
+      .dropped = (uint32_t)(sequence >> 3),
+      .connected = 1,
+  };
+  /* small integers, so floats are exact */
+  for (uint32_t axis = 0; axis < GAMEPAD_AXIS_COUNT; axis++)
+    state->axes[axis] = (float)((sequence & 0xffff) + axis);
+  for (uint32_t trigger = 0; trigger < GAMEPAD_TRIGGER_COUNT; trigger++)
+    state->triggers[trigger] = (float)((sequence & 0xff) + trigger);
+  for (uint32_t hat = 0; hat < GAMEPAD_HAT_COUNT; hat++) {
+    state->hats[hat][0] = (int8_t)((sequence + hat) % 3) - 1;
+    state->hats[hat][1] = (int8_t)((sequence + hat + 1) % 3) - 1;
+  }
+}
+
+/* Returns 1 when state is what state_fill writes for its sequence */
+static int state_valid(const struct gamepad_state *state, uint32_t slot) {
+  struct gamepad_state expected;
+  state_fill(&expected, slot, state->sequence);
+  if (state->sequence == 0)
+    return state->connected == 0;
+
+  uint8_t ok = state->timestamp == expected.timestamp &&
+               state->slot == expected.slot &&
+               state->buttons == expected.buttons &&
+               state->dropped == expected.dropped &&
+               state->connected == expected.connected;
+  for (uint32_t axis = 0; axis < GAMEPAD_AXIS_COUNT; axis++)
+    ok &= state->axes[axis] == expected.axes[axis];
+  for (uint32_t trigger = 0; trigger < GAMEPAD_TRIGGER_COUNT; trigger++)
+    ok &= state->triggers[trigger] == expected.triggers[trigger];
+  for (uint32_t hat = 0; hat < GAMEPAD_HAT_COUNT; hat++)
+    ok &= state->hats[hat][0] == expected.hats[hat][0] &&
+          state->hats[hat][1] == expected.hats[hat][1];
+  return ok;
+}
+
+struct reader {
+  pthread_t thread;
+  uint64_t reads;
+  uint64_t torn;
+  uint64_t backwards;
+};
+
+static void *reader_main(void *argument) {
+  struct reader *reader = argument;
+  uint64_t last[SLOT_COUNT] = {0};
+  struct gamepad_state state;
+  while (running) {
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+      gamepad_table_read(&table, slot, &state);
+      if (!state_valid(&state, slot))
+        reader->torn++;
+      if (state.sequence < last[slot])
+        reader->backwards++;
+      last[slot] = state.sequence;
+      reader->reads++;
+    }
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  uint32_t readers = 4;
+  uint32_t seconds = 2;
+  if ((argc > 1 && sscanf(argv[1], "%u", &readers) != 1) ||
+      (argc > 2 && sscanf(argv[2], "%u", &seconds) != 1) || readers == 0 ||
+      readers > READER_MAX) {
+    fprintf(stderr, "usage: stress-seqlock [readers] [seconds]\n");
+    return 1;
+  }
+
+  static struct reader reader[READER_MAX];
+  for (uint32_t index = 0; index < readers; index++)
+    pthread_create(&reader[index].thread, 0, reader_main, reader + index);
+
+  struct gamepad_state state;
+  uint64_t writes = 0;
+  uint64_t end = now_ns() + (uint64_t)seconds * 1000000000ull;
+  for (uint64_t sequence = 1; (sequence & 0xfff) || now_ns() < end;
+       sequence++) {
+    for (uint32_t slot = 0; slot < SLOT_COUNT; slot++) {
+      state_fill(&state, slot, sequence);
+      gamepad_table_publish(&table, slot, &state);
+    }
+    writes += SLOT_COUNT;
+  }
+  running = 0;
+
+  uint64_t reads = 0, torn = 0, backwards = 0;
+  for (uint32_t index = 0; index < readers; index++) {
+    pthread_join(reader[index].thread, 0);
+    reads += reader[index].reads;
+    torn += reader[index].torn;
+    backwards += reader[index].backwards;
+  }
+
+  printf("readers: %u, seconds: %u\n", readers, seconds);
+  printf("writes: %llu, reads: %llu\n", (unsigned long long)writes,
+         (unsigned long long)reads);
+  printf("torn: %llu, backwards: %llu\n", (unsigned long long)torn,
+         (unsigned long long)backwards);
+  return torn || backwards;
+}